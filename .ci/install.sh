@@ -4,7 +4,7 @@ set -ex
 
 if [ $TRAVIS_OS_NAME == osx ]; then
     brew update
-    brew install clang-format ninja
+    brew install clang-format ninja openssl
 
     curl https://bootstrap.pypa.io/get-pip.py -o get-pip.py
     sudo python get-pip.py
@@ -20,5 +20,6 @@ if [ $TRAVIS_OS_NAME == linux ]; then
     sudo apt-get update -qq
     sudo apt-get install -qq -y \
         cmake \
-        libsodium-dev
+        libsodium-dev \
+        libssl-dev
 fi
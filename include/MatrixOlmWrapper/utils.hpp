@@ -1,5 +1,6 @@
 #ifndef UTILS
 #define UTILS
+#include <algorithm>
 #include <functional>
 #include <iostream>
 #include <memory>
@@ -35,20 +36,27 @@ The above copyright notice and this permission notice shall be included in all
 copies or substantial portions of the Software.
 *
 */
+// Olm objects are constructed in place in a buffer from new uint8_t[], so the
+// object is cleared to wipe its keys and then that buffer is freed
 struct OlmDeleter
 {
-    void operator()(OlmAccount *ptr) { operator delete(ptr, olm_account_size()); }
-    void operator()(OlmUtility *ptr) { operator delete(ptr, olm_utility_size()); }
+    void operator()(OlmAccount *ptr) { olm_clear_account(ptr); free(ptr); }
+    void operator()(OlmUtility *ptr) { olm_clear_utility(ptr); free(ptr); }
 
-    void operator()(OlmSession *ptr) { operator delete(ptr, olm_session_size()); }
+    void operator()(OlmSession *ptr) { olm_clear_session(ptr); free(ptr); }
     void operator()(OlmOutboundGroupSession *ptr)
     {
-            operator delete(ptr, olm_outbound_group_session_size());
+            olm_clear_outbound_group_session(ptr);
+            free(ptr);
     }
     void operator()(OlmInboundGroupSession *ptr)
     {
-            operator delete(ptr, olm_inbound_group_session_size());
+            olm_clear_inbound_group_session(ptr);
+            free(ptr);
     }
+
+    private:
+    static void free(void *ptr) { delete[] static_cast<uint8_t *>(ptr); }
 };
 
 ////////////////////////////////////////////////////////////
@@ -57,7 +65,7 @@ struct OlmDeleter
 
 // Read the contents of a file to a string
 // Taken from: insanecoding.blogspot.com/2011/11/how-to-read-in-file-in-c.html
-std::string getFileContents(const char *filename)
+inline std::string getFileContents(const char *filename)
 {
   std::ifstream in(filename, std::ios::in | std::ios::binary);
   if (in)
@@ -74,14 +82,15 @@ std::string getFileContents(const char *filename)
 }
 
 // buffer_size is the size of the buffer in number of bytes
-unique_ptr<uint8_t[]> getRandData(unsigned int buffer_size) {
+inline unique_ptr<uint8_t[]> getRandData(unsigned int buffer_size) {
     unique_ptr<uint8_t[]> buffer(new uint8_t[buffer_size]);
     randombytes_buf(buffer.get(), buffer_size);
     return buffer;
 }
 
-// returns (success_status, user_id, device_id, ed25519_key) if found
-tuple<bool, string, string, string> getMsgInfo(json& m) {
+// returns (success_status, user_id, device_id, ed25519_key) if found. If the
+// message is malformed and error is given, the reason is written to it.
+inline tuple<bool, string, string, string> getMsgInfo(json& m, string* error = nullptr) {
     tuple<bool, string, string, string> unsuccessful;
     try {
         string user     = m["signatures"].begin().key();
@@ -97,12 +106,13 @@ tuple<bool, string, string, string> getMsgInfo(json& m) {
         }
         return {true, user, dev, sentKey};
     } catch (exception& e) {
-        cout << "Encountered an issue during Message Sender Info Retrieval: " << endl
-             << e.what() << endl;
+        if (error) {
+            *error = e.what();
+        }
         return unsuccessful;
     }
 }
-bool getMsgUsrId(json& m, string& usr) {
+inline bool getMsgUsrId(json& m, string& usr) {
     auto info = getMsgInfo(m);
     if (get<0>(info)) {
         usr = get<1>(info);
@@ -111,7 +121,7 @@ bool getMsgUsrId(json& m, string& usr) {
         return false;
     }
 }
-bool getMsgDevId(json& m, string& dev) {
+inline bool getMsgDevId(json& m, string& dev) {
     auto info = getMsgInfo(m);
     if (get<0>(info)) {
         dev = get<2>(info);
@@ -120,7 +130,7 @@ bool getMsgDevId(json& m, string& dev) {
         return false;
     }
 }
-bool getMsgKey(json& m, string& key) {
+inline bool getMsgKey(json& m, string& key) {
     auto info = getMsgInfo(m);
     if (get<0>(info)) {
         key = get<3>(info);
@@ -130,9 +140,38 @@ bool getMsgKey(json& m, string& key) {
     }
 }
 
+// Reads the message index out of an unpadded base64 megolm message without
+// decrypting it. The message starts with a version byte followed by the
+// index as a protobuf style varint field (tag 0x08).
+inline bool getMegolmMessageIndex(const string& ciphertext, uint32_t& index) {
+    // 16 base64 characters decode to 12 bytes, enough for the version byte,
+    // the tag and the longest possible 32 bit varint
+    size_t b64_len = min<size_t>(ciphertext.size(), 16) & ~size_t(3);
+    uint8_t bin[12];
+    size_t bin_len;
+    if (sodium_base642bin(bin, sizeof(bin), ciphertext.data(), b64_len, nullptr, &bin_len,
+                          nullptr, sodium_base64_VARIANT_ORIGINAL_NO_PADDING) != 0 ||
+        bin_len < 3 || bin[0] != 0x03 || bin[1] != 0x08) {
+        return false;
+    }
+
+    uint64_t value = 0;
+    for (size_t i = 2, shift = 0; i < bin_len && shift < 35; ++i, shift += 7) {
+        value |= uint64_t(bin[i] & 0x7F) << shift;
+        if (!(bin[i] & 0x80)) {
+            if (value > UINT32_MAX) {
+                return false;
+            }
+            index = static_cast<uint32_t>(value);
+            return true;
+        }
+    }
+    return false;
+}
+
 // Encodes the json object to a properly formatted string (According to
 // https://matrix.org/speculator/spec/HEAD/appendices.html#signing-json)
-void toSignable(json data, string& encoded) {
+inline void toSignable(json data, string& encoded) {
     // Remove data which shouldnt be signed
     data.erase("signatures");
     data.erase("unsigned");
@@ -142,27 +181,29 @@ void toSignable(json data, string& encoded) {
 }
 
 // Generate a base64 encoded signature
-string signData(const string& message, shared_ptr<OlmAccount> acct) {
-    int sig_len      = olm_account_signature_length(acct.get());
+inline string signData(const string& message, shared_ptr<OlmAccount> acct) {
+    size_t sig_len   = olm_account_signature_length(acct.get());
     unique_ptr<uint8_t[]> sig(new uint8_t[sig_len]);
-    if (olm_error() != olm_account_sign(acct.get(), message.data(), message.size(), sig.get(), sig_len)) {
-        return string(reinterpret_cast<const char*>(sig.get()));
+    size_t written   = olm_account_sign(acct.get(), message.data(), message.size(), sig.get(), sig_len);
+    if (olm_error() != written) {
+        // The signature isn't NUL terminated
+        return string(reinterpret_cast<const char*>(sig.get()), written);
     }
     return string();
 }
-string signData(const json& message, shared_ptr<OlmAccount> acct) {
+inline string signData(const json& message, shared_ptr<OlmAccount> acct) {
     string m;
     toSignable(message, m);
     return signData(m, acct);
 }
 
 // Verify a signature
-bool verify(string& message, string& sig, string& key) {
+inline bool verify(string& message, string& sig, string& key) {
     //TODO Create a utility
     unique_ptr<OlmUtility, OlmDeleter> util(olm_utility(new uint8_t[olm_utility_size()]));
     return olm_error() != olm_ed25519_verify(util.get(), key.data(), key.size(), message.data(), message.size(), sig.data(), sig.size());
 }
-bool verify(json& message, string& key) {
+inline bool verify(json& message, string& key) {
     // sig = signatures.user_id.key
     string sig = message["signatures"].begin().value().begin().value();
     string m_formatted;
@@ -9,7 +9,12 @@ using namespace std;
 // The below class needs to be implemented by the client in the described
 // format before any homeserver interactions can take place. Client provided
 // functions should take in strings of the json objects related to the
-// endpoint they are contacting unless otherwise specified
+// endpoint they are contacting unless otherwise specified.
+//
+// These functions may be called concurrently from several threads: the
+// wrapper's background key upload thread, the session prefetcher once
+// enabled, and any threads the client itself calls into the wrapper from.
+// Implementations must be safe to call from multiple threads at once.
 class APIWrapper {
     public:
     using keyRequestErr = experimental::optional<string>;
@@ -0,0 +1,207 @@
+#include "Attachment.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <openssl/evp.h>
+#include <sodium.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "CryptoUtils.hpp"
+
+namespace OlmWrapper {
+
+namespace {
+
+constexpr size_t key_size = 32;
+constexpr size_t iv_size  = 16;
+
+// Calls process with consecutive chunks of at most attachment_chunk_size
+// bytes read from fd until EOF. Regular files are mapped into memory instead
+// of being copied through a buffer. Returns false on an I/O error.
+bool forEachChunk(int fd, const function<void(const uint8_t*, size_t)>& process) {
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        off_t offset = lseek(fd, 0, SEEK_CUR);
+        if (offset >= 0 && offset < st.st_size) {
+            // mmap offsets have to be page aligned
+            off_t page_offset = offset - offset % sysconf(_SC_PAGESIZE);
+            size_t map_len    = st.st_size - page_offset;
+            void* map = mmap(nullptr, map_len, PROT_READ, MAP_PRIVATE, fd, page_offset);
+            if (map != MAP_FAILED) {
+                madvise(map, map_len, MADV_SEQUENTIAL);
+                const uint8_t* data = static_cast<const uint8_t*>(map) + (offset - page_offset);
+                size_t len          = st.st_size - offset;
+                for (size_t pos = 0; pos < len; pos += attachment_chunk_size) {
+                    process(data + pos, min(attachment_chunk_size, len - pos));
+                }
+                munmap(map, map_len);
+                lseek(fd, st.st_size, SEEK_SET);
+                return true;
+            }
+        }
+    }
+
+    unique_ptr<uint8_t[]> buffer(new uint8_t[attachment_chunk_size]);
+    while (true) {
+        ssize_t n = read(fd, buffer.get(), attachment_chunk_size);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        } else if (n == 0) {
+            return true;
+        }
+        process(buffer.get(), static_cast<size_t>(n));
+    }
+}
+
+// Runs AES-256-CTR over chunks of data while hashing the ciphertext side
+class CtrPass {
+    public:
+    CtrPass(const uint8_t* key, const uint8_t* iv, bool encrypting_, const AttachmentSink& sink_)
+        : ctx(EVP_CIPHER_CTX_new()), out(new uint8_t[attachment_chunk_size]),
+          encrypting(encrypting_), sink(sink_) {
+        ok = ctx && EVP_EncryptInit_ex(ctx.get(), EVP_aes_256_ctr(), nullptr, key, iv) == 1;
+        crypto_hash_sha256_init(&hash_state);
+    }
+
+    void update(const uint8_t* in, size_t len) {
+        if (!ok) {
+            return;
+        }
+        if (!encrypting) {
+            crypto_hash_sha256_update(&hash_state, in, len);
+        }
+
+        // CTR mode doesn't buffer, so output is always the same size as input
+        int out_len;
+        if (EVP_EncryptUpdate(ctx.get(), out.get(), &out_len, in, static_cast<int>(len)) != 1) {
+            ok = false;
+            return;
+        }
+        if (encrypting) {
+            crypto_hash_sha256_update(&hash_state, out.get(), out_len);
+        }
+        sink(out.get(), out_len);
+    }
+
+    // Writes the ciphertext hash, returning false if any step failed
+    bool finish(uint8_t* hash) {
+        crypto_hash_sha256_final(&hash_state, hash);
+        return ok;
+    }
+
+    private:
+    unique_ptr<EVP_CIPHER_CTX, CipherCtxDeleter> ctx;
+    unique_ptr<uint8_t[]> out;
+    crypto_hash_sha256_state hash_state;
+    bool encrypting;
+    bool ok;
+    const AttachmentSink& sink;
+};
+
+json encryptWith(const function<bool(CtrPass&)>& feed, const AttachmentSink& sink) {
+    // Only the top 64 bits of the IV are random, leaving the counter room to
+    // run without wrapping as other clients expect
+    uint8_t key[key_size];
+    uint8_t iv[iv_size] = {0};
+    randombytes_buf(key, key_size);
+    randombytes_buf(iv, iv_size / 2);
+
+    CtrPass pass(key, iv, true, sink);
+    uint8_t hash[crypto_hash_sha256_BYTES];
+    bool ok = feed(pass) && pass.finish(hash);
+
+    json encrypted_file;
+    if (ok) {
+        encrypted_file = {
+            {"v", "v2"},
+            {"key",
+             {{"kty", "oct"},
+              {"key_ops", {"encrypt", "decrypt"}},
+              {"alg", "A256CTR"},
+              {"k", toBase64(key, key_size, sodium_base64_VARIANT_URLSAFE_NO_PADDING)},
+              {"ext", true}}},
+            {"iv", toBase64(iv, iv_size, sodium_base64_VARIANT_ORIGINAL_NO_PADDING)},
+            {"hashes",
+             {{"sha256",
+               toBase64(hash, sizeof(hash), sodium_base64_VARIANT_ORIGINAL_NO_PADDING)}}}};
+    }
+    sodium_memzero(key, key_size);
+    return ok ? encrypted_file : json(nullptr);
+}
+
+bool decryptWith(const function<bool(CtrPass&)>& feed, const json& encrypted_file,
+                 const AttachmentSink& sink) {
+    uint8_t key[key_size];
+    uint8_t iv[iv_size];
+    uint8_t expected_hash[crypto_hash_sha256_BYTES];
+    try {
+        if (encrypted_file.at("key").at("alg") != "A256CTR" ||
+            !fromBase64(encrypted_file.at("key").at("k").get<string>(), key, key_size,
+                        sodium_base64_VARIANT_URLSAFE_NO_PADDING) ||
+            !fromBase64(encrypted_file.at("iv").get<string>(), iv, iv_size,
+                        sodium_base64_VARIANT_ORIGINAL_NO_PADDING) ||
+            !fromBase64(encrypted_file.at("hashes").at("sha256").get<string>(), expected_hash,
+                        sizeof(expected_hash), sodium_base64_VARIANT_ORIGINAL_NO_PADDING)) {
+            return false;
+        }
+    } catch (const exception&) {
+        // Malformed descriptor
+        return false;
+    }
+
+    CtrPass pass(key, iv, false, sink);
+    sodium_memzero(key, key_size);
+    uint8_t hash[crypto_hash_sha256_BYTES];
+    return feed(pass) && pass.finish(hash) &&
+           sodium_memcmp(hash, expected_hash, sizeof(hash)) == 0;
+}
+}
+
+json encryptAttachment(int fd, const AttachmentSink& sink) {
+    return encryptWith(
+        [fd](CtrPass& pass) {
+            return forEachChunk(fd, [&](const uint8_t* in, size_t len) { pass.update(in, len); });
+        },
+        sink);
+}
+
+json encryptAttachment(const uint8_t* data, size_t len, const AttachmentSink& sink) {
+    return encryptWith(
+        [=](CtrPass& pass) {
+            for (size_t pos = 0; pos < len; pos += attachment_chunk_size) {
+                pass.update(data + pos, min(attachment_chunk_size, len - pos));
+            }
+            return true;
+        },
+        sink);
+}
+
+bool decryptAttachment(int fd, const json& encrypted_file, const AttachmentSink& sink) {
+    return decryptWith(
+        [fd](CtrPass& pass) {
+            return forEachChunk(fd, [&](const uint8_t* in, size_t len) { pass.update(in, len); });
+        },
+        encrypted_file, sink);
+}
+
+bool decryptAttachment(const uint8_t* data, size_t len, const json& encrypted_file,
+                       const AttachmentSink& sink) {
+    return decryptWith(
+        [=](CtrPass& pass) {
+            for (size_t pos = 0; pos < len; pos += attachment_chunk_size) {
+                pass.update(data + pos, min(attachment_chunk_size, len - pos));
+            }
+            return true;
+        },
+        encrypted_file, sink);
+}
+}
@@ -0,0 +1,45 @@
+#ifndef ATTACHMENT
+#define ATTACHMENT
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+
+#include <json.hpp>
+
+using json = nlohmann::json;
+using namespace std;
+
+namespace OlmWrapper {
+
+// Receives the output of the attachment functions one chunk at a time. The
+// buffer is only valid for the duration of the call.
+using AttachmentSink = function<void(const uint8_t* data, size_t len)>;
+
+// Size of the chunks input is processed in, and the most handed to a sink at once
+constexpr size_t attachment_chunk_size = 64 * 1024;
+
+// Encrypted attachments as described in
+// https://matrix.org/docs/spec/client_server/r0.4.0.html#sending-encrypted-attachments
+// use AES-256-CTR with a fresh key per file and a SHA-256 hash of the
+// ciphertext. Input is processed in fixed size chunks with the hash computed
+// in the same pass, so memory use doesn't depend on the size of the file.
+// AES goes through OpenSSL, which uses the CPU's AES instructions when present.
+
+// Encrypts everything that can be read from fd, passing the ciphertext to
+// sink. Regular files are mmap'd, anything else (pipes, sockets) is read.
+// Returns the EncryptedFile descriptor without its "url", which should be
+// added once the ciphertext has been uploaded, or nullptr on error.
+json encryptAttachment(int fd, const AttachmentSink& sink);
+json encryptAttachment(const uint8_t* data, size_t len, const AttachmentSink& sink);
+
+// Decrypts the ciphertext read from fd using the key, iv and hash from the
+// EncryptedFile descriptor, passing the plaintext to sink. Returns false on
+// error or if the ciphertext doesn't match the hash. Since the hash can only
+// be checked once all the data has been seen, whatever was passed to sink
+// must be discarded if false is returned.
+bool decryptAttachment(int fd, const json& encrypted_file, const AttachmentSink& sink);
+bool decryptAttachment(const uint8_t* data, size_t len, const json& encrypted_file,
+                       const AttachmentSink& sink);
+}
+#endif
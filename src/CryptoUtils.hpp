@@ -0,0 +1,37 @@
+#ifndef CRYPTO_UTILS
+#define CRYPTO_UTILS
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <openssl/evp.h>
+#include <sodium.h>
+
+using namespace std;
+
+// Helpers shared by the attachment and key export code
+namespace OlmWrapper {
+
+struct CipherCtxDeleter {
+    void operator()(EVP_CIPHER_CTX* ctx) { EVP_CIPHER_CTX_free(ctx); }
+};
+
+// Encodes data with the given sodium_base64_VARIANT
+inline string toBase64(const uint8_t* data, size_t len, int variant) {
+    vector<char> b64(sodium_base64_ENCODED_LEN(len, variant));
+    sodium_bin2base64(b64.data(), b64.size(), data, len, variant);
+    return string(b64.data());
+}
+
+// Decodes base64 which may or may not be padded, returning false unless it
+// decodes to exactly len bytes
+inline bool fromBase64(string b64, uint8_t* out, size_t len, int variant) {
+    b64.erase(b64.find_last_not_of('=') + 1);
+    size_t out_len;
+    return sodium_base642bin(out, len, b64.data(), b64.size(), nullptr, &out_len, nullptr,
+                             variant) == 0 &&
+           out_len == len;
+}
+}
+#endif
@@ -0,0 +1,58 @@
+#include "GroupSessionStore.hpp"
+
+#include "utils.hpp"
+
+namespace OlmWrapper {
+
+shared_ptr<OlmInboundGroupSession> newInboundGroupSession() {
+    return shared_ptr<OlmInboundGroupSession>(
+        olm_inbound_group_session(new uint8_t[olm_inbound_group_session_size()]),
+        utils::OlmDeleter());
+}
+
+string inboundGroupSessionId(OlmInboundGroupSession* session) {
+    size_t id_len = olm_inbound_group_session_id_length(session);
+    unique_ptr<uint8_t[]> id(new uint8_t[id_len]);
+    if (olm_error() == olm_inbound_group_session_id(session, id.get(), id_len)) {
+        return string();
+    }
+    return string(reinterpret_cast<const char*>(id.get()), id_len);
+}
+
+bool GroupSessionStore::add(const string& session_id, InboundGroupSession s) {
+    Key key(s.room_id, s.sender_key, session_id);
+
+    lock_guard<mutex> lock(mtx);
+    auto it = sessions.find(key);
+    if (it != sessions.end() &&
+        olm_inbound_group_session_first_known_index(it->second.session.get()) <=
+            olm_inbound_group_session_first_known_index(s.session.get())) {
+        return false;
+    }
+    sessions[key] = move(s);
+    return true;
+}
+
+InboundGroupSession GroupSessionStore::get(const string& room_id, const string& sender_key,
+                                           const string& session_id) const {
+    lock_guard<mutex> lock(mtx);
+    auto it = sessions.find(Key(room_id, sender_key, session_id));
+    return it != sessions.end() ? it->second : InboundGroupSession();
+}
+
+vector<pair<GroupSessionStore::Key, InboundGroupSession>>
+GroupSessionStore::batch(size_t limit, const Key* after) const {
+    vector<pair<Key, InboundGroupSession>> out;
+    lock_guard<mutex> lock(mtx);
+    auto it = after ? sessions.upper_bound(*after) : sessions.begin();
+    for (; it != sessions.end() && out.size() < limit; ++it) {
+        out.push_back(*it);
+    }
+    return out;
+}
+
+size_t GroupSessionStore::size() const {
+    lock_guard<mutex> lock(mtx);
+    return sessions.size();
+}
+}
@@ -0,0 +1,66 @@
+#ifndef GROUP_SESSION_STORE
+#define GROUP_SESSION_STORE
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include <json.hpp>
+#include <olm/olm.h>
+
+using json = nlohmann::json;
+using namespace std;
+
+namespace OlmWrapper {
+
+// An inbound megolm session along with what is known about where it came from
+struct InboundGroupSession {
+    shared_ptr<OlmInboundGroupSession> session;
+    string room_id;
+    // Curve25519 key of the device which created the session
+    string sender_key;
+    // Keys the sending device claims to own, e.g. {"ed25519": "<key>"}
+    json sender_claimed_keys = json::object();
+    // Curve25519 keys of devices the session was forwarded through
+    json forwarding_curve25519_key_chain = json::array();
+};
+
+// Allocates an empty olm inbound group session which is freed when the last
+// reference to it goes away
+shared_ptr<OlmInboundGroupSession> newInboundGroupSession();
+
+// Returns the base64 session_id of session
+string inboundGroupSessionId(OlmInboundGroupSession* session);
+
+// Keeps track of inbound megolm sessions, keyed by
+// (room_id, sender_key, session_id). Safe to use from multiple threads.
+class GroupSessionStore {
+    public:
+    using Key = tuple<string, string, string>;
+
+    // Adds s under session_id. If the store already holds that session and it
+    // can decrypt from an earlier message index, the existing one is kept.
+    // Returns true if s was stored.
+    bool add(const string& session_id, InboundGroupSession s);
+
+    // Returns the session, or one with a null session if none is stored
+    InboundGroupSession get(const string& room_id, const string& sender_key,
+                            const string& session_id) const;
+
+    // Copies out up to limit sessions in key order, starting after the given
+    // key or from the beginning if after is null. Only references to the olm
+    // sessions are copied, so walking the store in batches keeps the memory
+    // needed to visit every session bounded.
+    vector<pair<Key, InboundGroupSession>> batch(size_t limit, const Key* after = nullptr) const;
+
+    size_t size() const;
+
+    private:
+    mutable mutex mtx;
+    map<Key, InboundGroupSession> sessions;
+};
+}
+#endif
@@ -0,0 +1,585 @@
+#include "KeyExport.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <condition_variable>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <openssl/evp.h>
+#include <sodium.h>
+
+#include "CryptoUtils.hpp"
+
+namespace OlmWrapper {
+
+namespace {
+
+const char header_line[]      = "-----BEGIN MEGOLM SESSION DATA-----";
+const char footer_line[]      = "-----END MEGOLM SESSION DATA-----";
+const char megolm_algorithm[] = "m.megolm.v1.aes-sha2";
+
+constexpr uint8_t format_version = 1;
+constexpr size_t salt_size       = 16;
+constexpr size_t iv_size         = 16;
+constexpr size_t mac_size        = crypto_auth_hmacsha256_BYTES;
+// version | salt | iv | rounds, all covered by the MAC
+constexpr size_t prefix_size = 1 + salt_size + iv_size + 4;
+// Bytes per line of output, giving 96 base64 characters
+constexpr size_t line_bytes = 72;
+// Sessions serialized or imported per round of work handed to the workers
+constexpr size_t batch_size = 1024;
+// Most plaintext encrypted or decrypted per cipher call
+constexpr size_t crypt_chunk_size = 64 * 1024;
+
+// The AES and HMAC keys derived from the passphrase
+struct ExportKeys {
+    uint8_t aes[32];
+    uint8_t hmac[32];
+
+    ~ExportKeys() { sodium_memzero(this, sizeof(*this)); }
+};
+
+bool deriveKeys(const string& passphrase, const uint8_t* salt, uint32_t rounds,
+                ExportKeys& keys) {
+    if (rounds == 0 || rounds > key_export_max_rounds) {
+        return false;
+    }
+    return PKCS5_PBKDF2_HMAC(passphrase.data(), static_cast<int>(passphrase.size()), salt,
+                             salt_size, static_cast<int>(rounds), EVP_sha512(), sizeof(keys),
+                             reinterpret_cast<uint8_t*>(&keys)) == 1;
+}
+
+// Threads which live for a whole export or import and are handed one batch
+// of sessions at a time. The calling thread works on each batch as well.
+class WorkerPool {
+    public:
+    // 0 workers means one per hardware thread
+    explicit WorkerPool(unsigned workers) {
+        if (workers == 0) {
+            workers = max(thread::hardware_concurrency(), 1u);
+        }
+        for (unsigned w = 1; w < workers; ++w) {
+            threads.emplace_back([this]() { work(); });
+        }
+    }
+
+    ~WorkerPool() {
+        {
+            lock_guard<mutex> lock(mtx);
+            stopping = true;
+        }
+        start.notify_all();
+        for (auto& t : threads) {
+            t.join();
+        }
+    }
+
+    // Runs fn(i) for every i in [0, n), returning once all calls are done.
+    // fn must not throw.
+    void run(size_t n, const function<void(size_t)>& fn_) {
+        {
+            lock_guard<mutex> lock(mtx);
+            fn     = &fn_;
+            count  = n;
+            next   = 0;
+            active = threads.size();
+            ++generation;
+        }
+        start.notify_all();
+        drain();
+
+        unique_lock<mutex> lock(mtx);
+        done.wait(lock, [this]() { return active == 0; });
+    }
+
+    private:
+    void work() {
+        uint64_t seen = 0;
+        unique_lock<mutex> lock(mtx);
+        while (true) {
+            start.wait(lock, [&]() { return stopping || generation != seen; });
+            if (stopping) {
+                return;
+            }
+            seen = generation;
+
+            lock.unlock();
+            drain();
+            lock.lock();
+            if (--active == 0) {
+                done.notify_one();
+            }
+        }
+    }
+
+    // Claims indexes of the current batch until none are left
+    void drain() {
+        for (size_t i = next++; i < count; i = next++) {
+            (*fn)(i);
+        }
+    }
+
+    vector<thread> threads;
+    mutex mtx;
+    condition_variable start;
+    condition_variable done;
+    // Batch being worked on, only changed while no worker is draining
+    const function<void(size_t)>* fn = nullptr;
+    size_t count                     = 0;
+    atomic<size_t> next{0};
+    // Workers still draining the current batch
+    size_t active = 0;
+    // Bumped for every batch so each worker picks it up exactly once
+    uint64_t generation = 0;
+    bool stopping       = false;
+};
+
+// Serializes one session as an element of the export array, returning an
+// empty string if it couldn't be exported, e.g. because olm failed or a field
+// isn't valid UTF-8. Runs on the worker threads, so it must not throw.
+string serializeSession(const GroupSessionStore::Key& key, const InboundGroupSession& s) {
+    try {
+        OlmInboundGroupSession* session = s.session.get();
+        size_t key_len                  = olm_export_inbound_group_session_length(session);
+        unique_ptr<uint8_t[]> session_key(new uint8_t[key_len]);
+        if (olm_error() == olm_export_inbound_group_session(
+                               session, session_key.get(), key_len,
+                               olm_inbound_group_session_first_known_index(session))) {
+            return string();
+        }
+
+        json entry = {
+            {"algorithm", megolm_algorithm},
+            {"forwarding_curve25519_key_chain", s.forwarding_curve25519_key_chain},
+            {"room_id", get<0>(key)},
+            {"sender_claimed_keys", s.sender_claimed_keys},
+            {"sender_key", get<1>(key)},
+            {"session_id", get<2>(key)},
+            {"session_key", string(reinterpret_cast<const char*>(session_key.get()), key_len)}};
+        sodium_memzero(session_key.get(), key_len);
+        string text = entry.dump();
+        sodium_memzero(&entry["session_key"].get_ref<string&>()[0], key_len);
+        return text;
+    } catch (const exception&) {
+        return string();
+    }
+}
+
+// Imports one element of the export array, returning false if it isn't a
+// usable megolm session
+bool importSession(const string& text, pair<string, InboundGroupSession>& out) {
+    try {
+        json entry = json::parse(text);
+        if (entry.at("algorithm") != megolm_algorithm) {
+            return false;
+        }
+
+        string session_key = entry.at("session_key");
+        auto session       = newInboundGroupSession();
+        size_t ret         = olm_import_inbound_group_session(
+            session.get(), reinterpret_cast<const uint8_t*>(session_key.data()),
+            session_key.size());
+        sodium_memzero(&session_key[0], session_key.size());
+        if (olm_error() == ret) {
+            return false;
+        }
+
+        // The id is derived from the key, so a mismatch means a corrupt entry
+        string session_id = entry.at("session_id");
+        if (inboundGroupSessionId(session.get()) != session_id) {
+            return false;
+        }
+
+        InboundGroupSession s;
+        s.session    = session;
+        s.room_id    = entry.at("room_id").get<string>();
+        s.sender_key = entry.at("sender_key").get<string>();
+        if (entry.count("sender_claimed_keys") > 0) {
+            s.sender_claimed_keys = entry["sender_claimed_keys"];
+        }
+        if (entry.count("forwarding_curve25519_key_chain") > 0) {
+            s.forwarding_curve25519_key_chain = entry["forwarding_curve25519_key_chain"];
+        }
+        out = {session_id, move(s)};
+        return true;
+    } catch (const exception&) {
+        return false;
+    }
+}
+
+// Base64 encodes everything written to it into fixed length lines
+class Base64LineWriter {
+    public:
+    explicit Base64LineWriter(ostream& out_) : out(out_) {}
+
+    void write(const uint8_t* data, size_t len) {
+        pending.insert(pending.end(), data, data + len);
+        size_t full = pending.size() - pending.size() % line_bytes;
+        for (size_t pos = 0; pos < full; pos += line_bytes) {
+            writeLine(&pending[pos], line_bytes);
+        }
+        pending.erase(pending.begin(), pending.begin() + full);
+    }
+
+    void finish() {
+        if (!pending.empty()) {
+            writeLine(pending.data(), pending.size());
+            pending.clear();
+        }
+    }
+
+    private:
+    void writeLine(const uint8_t* data, size_t len) {
+        out << toBase64(data, len, sodium_base64_VARIANT_ORIGINAL) << '\n';
+    }
+
+    ostream& out;
+    vector<uint8_t> pending;
+};
+
+// Encrypts the export as it is produced and writes it out in its final form
+class ExportWriter {
+    public:
+    explicit ExportWriter(ostream& out_)
+        : out(out_), b64(out_), ctx(EVP_CIPHER_CTX_new()), buffer(new uint8_t[crypt_chunk_size]) {}
+
+    bool begin(const string& passphrase, uint32_t rounds) {
+        uint8_t prefix[prefix_size];
+        uint8_t* salt = prefix + 1;
+        uint8_t* iv   = salt + salt_size;
+        prefix[0]     = format_version;
+        randombytes_buf(salt, salt_size);
+        randombytes_buf(iv, iv_size);
+        // Clearing bit 63 keeps the counter from wrapping in implementations
+        // which only increment the low 64 bits
+        iv[8] &= 0x7F;
+        for (int i = 0; i < 4; ++i) {
+            prefix[1 + salt_size + iv_size + i] = static_cast<uint8_t>(rounds >> (24 - 8 * i));
+        }
+
+        ExportKeys keys;
+        if (!ctx || !deriveKeys(passphrase, salt, rounds, keys) ||
+            EVP_EncryptInit_ex(ctx.get(), EVP_aes_256_ctr(), nullptr, keys.aes, iv) != 1) {
+            return false;
+        }
+        crypto_auth_hmacsha256_init(&mac_state, keys.hmac, sizeof(keys.hmac));
+
+        out << header_line << '\n';
+        writeAuthenticated(prefix, prefix_size);
+        return true;
+    }
+
+    bool update(const string& plaintext) {
+        const uint8_t* data = reinterpret_cast<const uint8_t*>(plaintext.data());
+        for (size_t pos = 0; pos < plaintext.size(); pos += crypt_chunk_size) {
+            int len = static_cast<int>(min(crypt_chunk_size, plaintext.size() - pos));
+            int out_len;
+            if (EVP_EncryptUpdate(ctx.get(), buffer.get(), &out_len, data + pos, len) != 1) {
+                return false;
+            }
+            writeAuthenticated(buffer.get(), out_len);
+        }
+        return true;
+    }
+
+    void finish() {
+        uint8_t mac[mac_size];
+        crypto_auth_hmacsha256_final(&mac_state, mac);
+        b64.write(mac, mac_size);
+        b64.finish();
+        out << footer_line << '\n';
+        out.flush();
+    }
+
+    private:
+    void writeAuthenticated(const uint8_t* data, size_t len) {
+        crypto_auth_hmacsha256_update(&mac_state, data, len);
+        b64.write(data, len);
+    }
+
+    ostream& out;
+    Base64LineWriter b64;
+    unique_ptr<EVP_CIPHER_CTX, CipherCtxDeleter> ctx;
+    unique_ptr<uint8_t[]> buffer;
+    crypto_auth_hmacsha256_state mac_state;
+};
+
+// Splits the decrypted JSON array into the text of its elements without
+// parsing them, so only one session needs to be held at a time
+class ArraySplitter {
+    public:
+    explicit ArraySplitter(function<void(string&)> on_element_) : on_element(move(on_element_)) {}
+
+    // Returns false once the input can't be a JSON array of objects
+    bool feed(const char* data, size_t len) {
+        for (size_t i = 0; i < len && ok; ++i) {
+            char c = data[i];
+            if (depth >= 2) {
+                element.push_back(c);
+                if (in_string) {
+                    if (escaped) {
+                        escaped = false;
+                    } else if (c == '\\') {
+                        escaped = true;
+                    } else if (c == '"') {
+                        in_string = false;
+                    }
+                } else if (c == '"') {
+                    in_string = true;
+                } else if (c == '{' || c == '[') {
+                    ++depth;
+                } else if ((c == '}' || c == ']') && --depth == 1) {
+                    on_element(element);
+                    element.clear();
+                }
+            } else if (isspace(static_cast<unsigned char>(c))) {
+                continue;
+            } else if (depth == 0 && !started && c == '[') {
+                started = true;
+                depth   = 1;
+            } else if (depth == 1 && c == '{') {
+                depth = 2;
+                element.push_back(c);
+            } else if (depth == 1 && c == ']') {
+                depth = 0;
+            } else if (!(depth == 1 && c == ',')) {
+                ok = false;
+            }
+        }
+        return ok;
+    }
+
+    // True if a complete array was seen
+    bool complete() const { return ok && started && depth == 0; }
+
+    private:
+    function<void(string&)> on_element;
+    string element;
+    unsigned depth = 0;
+    bool started   = false;
+    bool in_string = false;
+    bool escaped   = false;
+    bool ok        = true;
+};
+
+// Authenticates and decrypts the binary export as it's decoded. The MAC
+// trails the ciphertext, so the last mac_size bytes seen are always held back.
+class ImportReader {
+    public:
+    ImportReader(const string& passphrase_, ArraySplitter& splitter_)
+        : passphrase(passphrase_), splitter(splitter_), ctx(EVP_CIPHER_CTX_new()),
+          buffer(new uint8_t[crypt_chunk_size]) {}
+
+    bool feed(const uint8_t* data, size_t len) {
+        if (!ok) {
+            return false;
+        }
+        if (prefix.size() < prefix_size) {
+            size_t take = min(len, prefix_size - prefix.size());
+            prefix.insert(prefix.end(), data, data + take);
+            data += take;
+            len -= take;
+            if (prefix.size() == prefix_size && !begin()) {
+                return ok = false;
+            }
+        }
+
+        tail.insert(tail.end(), data, data + len);
+        if (tail.size() > mac_size) {
+            size_t ready = tail.size() - mac_size;
+            for (size_t pos = 0; pos < ready; pos += crypt_chunk_size) {
+                int chunk = static_cast<int>(min(crypt_chunk_size, ready - pos));
+                int out_len;
+                crypto_auth_hmacsha256_update(&mac_state, &tail[pos], chunk);
+                if (EVP_DecryptUpdate(ctx.get(), buffer.get(), &out_len, &tail[pos], chunk) != 1 ||
+                    !splitter.feed(reinterpret_cast<const char*>(buffer.get()), out_len)) {
+                    return ok = false;
+                }
+            }
+            tail.erase(tail.begin(), tail.begin() + ready);
+        }
+        return true;
+    }
+
+    // True if reading stopped because the export asks for more KDF rounds
+    // than key_export_max_rounds
+    bool tooManyRounds() const { return too_many_rounds; }
+
+    // Returns true if the whole export was read and its MAC is valid
+    bool finish() {
+        if (!ok || prefix.size() < prefix_size || tail.size() != mac_size) {
+            return false;
+        }
+        uint8_t mac[mac_size];
+        crypto_auth_hmacsha256_final(&mac_state, mac);
+        return sodium_memcmp(mac, tail.data(), mac_size) == 0;
+    }
+
+    private:
+    bool begin() {
+        const uint8_t* salt = &prefix[1];
+        const uint8_t* iv   = salt + salt_size;
+        const uint8_t* r    = iv + iv_size;
+        uint32_t rounds     = (uint32_t(r[0]) << 24) | (uint32_t(r[1]) << 16) |
+                          (uint32_t(r[2]) << 8) | uint32_t(r[3]);
+        if (rounds > key_export_max_rounds) {
+            too_many_rounds = true;
+            return false;
+        }
+
+        ExportKeys keys;
+        if (prefix[0] != format_version || !ctx || !deriveKeys(passphrase, salt, rounds, keys) ||
+            EVP_DecryptInit_ex(ctx.get(), EVP_aes_256_ctr(), nullptr, keys.aes, iv) != 1) {
+            return false;
+        }
+        crypto_auth_hmacsha256_init(&mac_state, keys.hmac, sizeof(keys.hmac));
+        crypto_auth_hmacsha256_update(&mac_state, prefix.data(), prefix.size());
+        return true;
+    }
+
+    const string& passphrase;
+    ArraySplitter& splitter;
+    unique_ptr<EVP_CIPHER_CTX, CipherCtxDeleter> ctx;
+    unique_ptr<uint8_t[]> buffer;
+    crypto_auth_hmacsha256_state mac_state;
+    vector<uint8_t> prefix;
+    vector<uint8_t> tail;
+    bool ok              = true;
+    bool too_many_rounds = false;
+};
+}
+
+KeyExportError exportRoomKeys(const GroupSessionStore& store, const string& passphrase,
+                              ostream& out, unsigned rounds, unsigned workers) {
+    ExportWriter writer(out);
+    if (!writer.begin(passphrase, rounds)) {
+        return KeyExportError("Couldn't derive the export keys");
+    }
+
+    bool first = true;
+    if (!writer.update("[")) {
+        return KeyExportError("Couldn't encrypt the export");
+    }
+    WorkerPool pool(workers);
+    auto batch = store.batch(batch_size);
+    while (!batch.empty()) {
+        vector<string> serialized(batch.size());
+        pool.run(batch.size(), [&](size_t i) {
+            serialized[i] = serializeSession(batch[i].first, batch[i].second);
+        });
+
+        for (size_t i = 0; i < serialized.size(); ++i) {
+            if (serialized[i].empty()) {
+                return KeyExportError("Couldn't export session " + get<2>(batch[i].first));
+            }
+            if ((!first && !writer.update(",")) || !writer.update(serialized[i])) {
+                return KeyExportError("Couldn't encrypt the export");
+            }
+            first = false;
+        }
+
+        GroupSessionStore::Key last = batch.back().first;
+        batch                       = store.batch(batch_size, &last);
+    }
+    if (!writer.update("]")) {
+        return KeyExportError("Couldn't encrypt the export");
+    }
+    writer.finish();
+
+    if (!out) {
+        return KeyExportError("Couldn't write the export");
+    }
+    return KeyExportError();
+}
+
+tuple<size_t, KeyExportError> importRoomKeys(GroupSessionStore& store, const string& passphrase,
+                                             istream& in, unsigned workers) {
+    // Sessions are staged until the MAC has been checked at the very end
+    vector<pair<string, InboundGroupSession>> staged;
+    vector<string> pending;
+    WorkerPool pool(workers);
+    auto importPending = [&]() {
+        vector<pair<string, InboundGroupSession>> imported(pending.size());
+        vector<char> valid(pending.size(), 0);
+        pool.run(pending.size(),
+                 [&](size_t i) { valid[i] = importSession(pending[i], imported[i]); });
+        for (size_t i = 0; i < imported.size(); ++i) {
+            if (valid[i]) {
+                staged.push_back(move(imported[i]));
+            }
+        }
+        pending.clear();
+    };
+
+    ArraySplitter splitter([&](string& element) {
+        pending.push_back(move(element));
+        if (pending.size() >= batch_size) {
+            importPending();
+        }
+    });
+    ImportReader reader(passphrase, splitter);
+
+    string line;
+    while (getline(in, line) && line.find_first_not_of(" \t\r") == string::npos) {
+    }
+    if (line.compare(0, sizeof(header_line) - 1, header_line) != 0) {
+        return {0, KeyExportError("Missing key export header")};
+    }
+
+    // Base64 is decoded in whole groups of four characters as lines arrive
+    string b64;
+    vector<uint8_t> decoded;
+    bool found_footer = false;
+    while (getline(in, line)) {
+        if (line.compare(0, sizeof(footer_line) - 1, footer_line) == 0) {
+            found_footer = true;
+            break;
+        }
+        for (char c : line) {
+            if (!isspace(static_cast<unsigned char>(c))) {
+                b64.push_back(c);
+            }
+        }
+
+        size_t usable = b64.size() - b64.size() % 4;
+        decoded.resize(usable / 4 * 3);
+        size_t decoded_len;
+        if (sodium_base642bin(decoded.data(), decoded.size(), b64.data(), usable, nullptr,
+                              &decoded_len, nullptr, sodium_base64_VARIANT_ORIGINAL) != 0) {
+            return {0, KeyExportError("Key export isn't valid base64")};
+        }
+        b64.erase(0, usable);
+        if (!reader.feed(decoded.data(), decoded_len)) {
+            if (reader.tooManyRounds()) {
+                return {0, KeyExportError("Key export uses more KDF rounds than allowed")};
+            }
+            return {0, KeyExportError("Key export is corrupt or the passphrase is wrong")};
+        }
+    }
+
+    if (!found_footer || !b64.empty()) {
+        return {0, KeyExportError("Key export is truncated")};
+    }
+    if (!reader.finish()) {
+        return {0, KeyExportError("Key export is corrupt or the passphrase is wrong")};
+    }
+    if (!splitter.complete()) {
+        return {0, KeyExportError("Key export doesn't contain a list of sessions")};
+    }
+    importPending();
+
+    size_t added = 0;
+    for (auto& elem : staged) {
+        if (store.add(elem.first, move(elem.second))) {
+            ++added;
+        }
+    }
+    return {added, KeyExportError()};
+}
+}
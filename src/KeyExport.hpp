@@ -0,0 +1,51 @@
+#ifndef KEY_EXPORT
+#define KEY_EXPORT
+
+#include <experimental/optional>
+#include <istream>
+#include <ostream>
+#include <string>
+#include <tuple>
+
+#include "GroupSessionStore.hpp"
+
+using namespace std;
+
+namespace OlmWrapper {
+
+// Holds an error message if the operation failed
+using KeyExportError = experimental::optional<string>;
+
+// PBKDF2 rounds used when none are given, matching other Matrix clients
+constexpr unsigned key_export_default_rounds = 500000;
+// Most PBKDF2 rounds accepted. The count is read from the export before it
+// can be authenticated, so without a limit a crafted file could keep the
+// importing thread busy for hours.
+constexpr unsigned key_export_max_rounds = 10 * key_export_default_rounds;
+
+// Room keys are exported in the format described in
+// https://matrix.org/docs/spec/client_server/r0.4.0.html#key-exports
+// which is a JSON array of sessions, encrypted with AES-256-CTR and
+// authenticated with HMAC-SHA-256 using keys derived from a passphrase, then
+// base64 encoded between BEGIN/END MEGOLM SESSION DATA lines.
+//
+// Both directions stream: sessions are serialized, encrypted and written in
+// batches, and imports are decrypted and split into individual sessions as
+// the input is read, so neither the whole JSON array nor its DOM is ever held
+// in memory. The passphrase KDF runs once per call. Exporting and importing
+// the olm sessions themselves, the expensive part, is spread across workers
+// threads, with 0 meaning one per hardware thread.
+
+// Writes every session in store to out, encrypted with passphrase
+KeyExportError exportRoomKeys(const GroupSessionStore& store, const string& passphrase,
+                              ostream& out, unsigned rounds = key_export_default_rounds,
+                              unsigned workers = 0);
+
+// Reads a key export from in and adds its sessions to store, returning the
+// number of sessions added. Entries which are malformed or use an unknown
+// algorithm are skipped. Nothing is added unless the whole export decrypted
+// and authenticated successfully.
+tuple<size_t, KeyExportError> importRoomKeys(GroupSessionStore& store, const string& passphrase,
+                                             istream& in, unsigned workers = 0);
+}
+#endif
@@ -0,0 +1,120 @@
+#include "Logger.hpp"
+
+#include <algorithm>
+#include <iostream>
+
+namespace OlmWrapper {
+
+static const char* levelName(LogLevel level) {
+    switch (level) {
+    case LogLevel::Debug:
+        return "debug";
+    case LogLevel::Info:
+        return "info";
+    case LogLevel::Warn:
+        return "warn";
+    default:
+        return "error";
+    }
+}
+
+// Length of the UTF-8 sequence starting at s[i], or 0 if it isn't valid
+static size_t utf8SequenceLength(const string& s, size_t i) {
+    auto byte = [&](size_t j) { return static_cast<unsigned char>(s[j]); };
+    auto cont = [&](size_t j, unsigned char lo, unsigned char hi) {
+        return j < s.size() && byte(j) >= lo && byte(j) <= hi;
+    };
+
+    unsigned char c = byte(i);
+    if (c < 0x80) {
+        return 1;
+    } else if (c >= 0xC2 && c <= 0xDF) {
+        return cont(i + 1, 0x80, 0xBF) ? 2 : 0;
+    } else if (c >= 0xE0 && c <= 0xEF) {
+        unsigned char lo = c == 0xE0 ? 0xA0 : 0x80;
+        unsigned char hi = c == 0xED ? 0x9F : 0xBF;
+        return cont(i + 1, lo, hi) && cont(i + 2, 0x80, 0xBF) ? 3 : 0;
+    } else if (c >= 0xF0 && c <= 0xF4) {
+        unsigned char lo = c == 0xF0 ? 0x90 : 0x80;
+        unsigned char hi = c == 0xF4 ? 0x8F : 0xBF;
+        return cont(i + 1, lo, hi) && cont(i + 2, 0x80, 0xBF) && cont(i + 3, 0x80, 0xBF) ? 4 : 0;
+    }
+    return 0;
+}
+
+// Replaces bytes which aren't valid UTF-8 with U+FFFD. Fields often carry
+// exception messages which echo raw input, and json refuses to dump those.
+static void sanitize(json& value) {
+    if (value.is_string()) {
+        const string& s = value.get_ref<const string&>();
+        string clean;
+        for (size_t i = 0; i < s.size();) {
+            size_t len = utf8SequenceLength(s, i);
+            if (len == 0) {
+                clean += "\xEF\xBF\xBD";
+                ++i;
+            } else {
+                clean.append(s, i, len);
+                i += len;
+            }
+        }
+        value = clean;
+    } else if (value.is_structured()) {
+        for (auto& elem : value) {
+            sanitize(elem);
+        }
+    }
+}
+
+void Logger::stderrSink(const json& record) { cerr << record.dump() << endl; }
+
+void Logger::log(LogLevel level, const string& event, json fields) {
+    auto now = chrono::steady_clock::now();
+
+    unique_lock<mutex> lock(mtx);
+    auto it = buckets.find(event);
+    if (it == buckets.end()) {
+        it = buckets.emplace(event, Bucket{static_cast<double>(burst), now, 0}).first;
+    }
+
+    // Refill the bucket for the time which passed since the last record
+    Bucket& bucket = it->second;
+    double elapsed = chrono::duration<double>(now - bucket.last_refill).count();
+    bucket.tokens  = min(static_cast<double>(burst), bucket.tokens + elapsed * per_second);
+    bucket.last_refill = now;
+
+    if (bucket.tokens < 1.0) {
+        ++bucket.suppressed;
+        if (suppressed_counter) {
+            suppressed_counter->inc();
+        }
+        return;
+    }
+    bucket.tokens -= 1.0;
+
+    json record = fields.is_object() ? move(fields) : json::object();
+    sanitize(record);
+    record["level"] = levelName(level);
+    record["event"] = event;
+    record["ts"] =
+        chrono::duration_cast<chrono::seconds>(chrono::system_clock::now().time_since_epoch())
+            .count();
+    if (bucket.suppressed > 0) {
+        record["suppressed"] = bucket.suppressed;
+        bucket.suppressed    = 0;
+    }
+
+    sanitize(record["event"]);
+
+    // The sink runs unlocked so that it may itself log
+    LogSink current_sink = sink;
+    lock.unlock();
+    if (current_sink) {
+        // Logging is best effort and must never fail the caller
+        try {
+            current_sink(record);
+        } catch (...) {
+        }
+    }
+}
+}
@@ -0,0 +1,76 @@
+#ifndef LOGGER
+#define LOGGER
+
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include <json.hpp>
+
+#include "Metrics.hpp"
+
+using json = nlohmann::json;
+using namespace std;
+
+namespace OlmWrapper {
+
+enum class LogLevel { Debug, Info, Warn, Error };
+
+// Emits one json object per record, e.g.
+// {"level":"error","event":"key_signing_failed","what":"...","ts":1526342400}
+// Each event name gets its own token bucket so a failure repeating in a tight
+// loop cannot flood the output. Records dropped by the limiter are counted and
+// reported in the "suppressed" field of the next record let through for that
+// event.
+//
+// Logging never throws. Invalid UTF-8 in string fields is replaced with
+// U+FFFD, exceptions from the sink are swallowed, and the sink is called
+// without the logger's lock held so it may log itself.
+class Logger {
+    public:
+    using LogSink = function<void(const json& record)>;
+
+    // Writes each record as a single line to stderr
+    static void stderrSink(const json& record);
+
+    // per_second is the steady state number of records allowed per event and
+    // burst is how many may be emitted back to back before limiting kicks in.
+    // suppressed_counter, if provided, is incremented for every dropped record.
+    Logger(LogSink sink_ = stderrSink, double per_second_ = 1.0, unsigned burst_ = 5,
+           Counter* suppressed_counter_ = nullptr)
+        : sink(move(sink_)), per_second(per_second_), burst(burst_),
+          suppressed_counter(suppressed_counter_) {}
+
+    void setSink(LogSink sink_) {
+        lock_guard<mutex> lock(mtx);
+        sink = move(sink_);
+    }
+
+    // fields must be a json object (or null) and is merged into the record
+    void log(LogLevel level, const string& event, json fields = json::object());
+
+    void warn(const string& event, json fields = json::object()) {
+        log(LogLevel::Warn, event, move(fields));
+    }
+    void error(const string& event, json fields = json::object()) {
+        log(LogLevel::Error, event, move(fields));
+    }
+
+    private:
+    struct Bucket {
+        double tokens;
+        chrono::steady_clock::time_point last_refill;
+        uint64_t suppressed;
+    };
+
+    mutex mtx;
+    LogSink sink;
+    double per_second;
+    unsigned burst;
+    Counter* suppressed_counter;
+    unordered_map<string, Bucket> buckets;
+};
+}
+#endif
@@ -9,54 +9,293 @@
 #include "utils.hpp"
 
 using namespace OlmWrapper::utils;
+using OlmWrapper::Metrics;
+using OlmWrapper::Op;
 
 bool MatrixOlmWrapper::verify(json& message) {
     try {
-        string usr, dev;
-        if (!getMsgUsrId(message, usr) || !getMsgDevId(message, dev)) {
+        string error;
+        auto info = getMsgInfo(message, &error);
+        if (!get<0>(info)) {
+            if (!error.empty()) {
+                logger.warn("message_info_invalid", {{"what", error}});
+            }
             return false;
         }
+        string usr = get<1>(info);
+        string dev = get<2>(info);
 
         // A valid public key should never be ""
         string key = getUserDeviceKey(usr, dev);
         // TODO check for empty key
         if (key.empty()) {
-            string sentKey;
-            if (getMsgKey(message, sentKey) && wrapper->promptVerifyDevice(usr, dev, sentKey)) {
-                verifyDevice(usr, dev, sentKey);
-                return OlmWrapper::utils::verify(message, sentKey);
-            } else {
+            string sentKey = get<3>(info);
+
+            bool trusted;
+            {
+                Metrics::Timer timer(metrics, Op::PromptVerifyDevice);
+                trusted = wrapper->promptVerifyDevice(usr, dev, sentKey);
+            }
+            if (!trusted) {
                 return false;
             }
-        } else {
-            return OlmWrapper::utils::verify(message, key);
+            verifyDevice(usr, dev, sentKey);
+            key = sentKey;
         }
+
+        Metrics::Timer timer(metrics, Op::Verify);
+        bool valid = OlmWrapper::utils::verify(message, key);
+        if (!valid) {
+            timer.fail();
+        }
+        return valid;
     } catch (exception& e) {
-        cout << "Encountered an issue during verification: " << endl << e.what() << endl;
+        logger.error("verification_failed", {{"what", e.what()}});
+        return false;
+    }
+}
+
+bool MatrixOlmWrapper::claimMessage(const string& secured_message) {
+    OlmWrapper::ReplayCache::Digest key;
+    // Messages the cache can't identify are always let through
+    if (replayKey(secured_message, key) && replay_cache.checkAndInsert(key)) {
+        metrics.replayed_messages.inc();
         return false;
     }
+    return true;
+}
+
+void MatrixOlmWrapper::releaseMessage(const string& secured_message) {
+    OlmWrapper::ReplayCache::Digest key;
+    if (replayKey(secured_message, key)) {
+        replay_cache.erase(key);
+    }
+}
+
+void MatrixOlmWrapper::enableSessionPrefetch(OlmWrapper::PrefetchConfig config) {
+    if (!prefetcher) {
+        prefetcher.reset(new OlmWrapper::SessionPrefetcher(
+            [this](const string& user, size_t max_claims) {
+                return prefetchSessions(user, max_claims);
+            },
+            config));
+        prefetcher->start();
+    }
+}
+
+MatrixOlmWrapper::~MatrixOlmWrapper() {
+    {
+        lock_guard<mutex> lock(key_thread_mtx);
+        stopping = true;
+    }
+    key_thread_wake.notify_all();
+    if (key_thread.joinable()) {
+        key_thread.join();
+    }
 }
 
 ////////////////////////////////////////////////////////////
 //                   Member Functions                     //
 ////////////////////////////////////////////////////////////
+bool MatrixOlmWrapper::hasSession(const string& curve_key) {
+    lock_guard<mutex> lock(sessions_mtx);
+    if (sessions.count(curve_key) > 0) {
+        metrics.prefetch_sessions_present.inc();
+        return true;
+    }
+    metrics.prefetch_sessions_missing.inc();
+    return false;
+}
+
+size_t MatrixOlmWrapper::prefetchSessions(const string& user, size_t max_claims) {
+    // Keys handed out by the homeserver are used up even if we can't make use
+    // of them, so they are counted against the budget whatever happens next
+    size_t num_claimed = 0;
+    try {
+        string query_user = user;
+        APIWrapper::matrAPIRet query =
+            callAPI(Op::QueryKeys, [&] { return wrapper->queryKeys(query_user); });
+        if (get<1>(query) || get<0>(query).empty()) {
+            return 0;
+        }
+
+        // Find the devices we have no session with, remembering their keys
+        // hashmap(device_id -> (curve25519_key, ed25519_key))
+        unordered_map<string, pair<string, string>> missing;
+        json claim;
+        json devices = json::parse(get<0>(query))["device_keys"][user];
+        for (auto it = devices.begin(); it != devices.end() && missing.size() < max_claims; ++it) {
+            string dev = it.key();
+            if (user == user_id && dev == device_id) {
+                continue;
+            }
+
+            // A malformed device is skipped without affecting the others
+            try {
+                json device = it.value();
+                if (device["keys"].count("curve25519:" + dev) == 0 ||
+                    device["keys"].count("ed25519:" + dev) == 0) {
+                    continue;
+                }
+                string curve_key = device["keys"]["curve25519:" + dev];
+                string ed_key    = device["keys"]["ed25519:" + dev];
+
+                // Skip devices whose keys don't match what was verified or
+                // aren't signed by the device itself
+                string known_key = getUserDeviceKey(user, dev);
+                if ((!known_key.empty() && known_key != ed_key) ||
+                    device.count("signatures") == 0 ||
+                    !OlmWrapper::utils::verify(device, ed_key)) {
+                    continue;
+                }
+
+                if (hasSession(curve_key)) {
+                    continue;
+                }
+                missing[dev]                      = {curve_key, ed_key};
+                claim["one_time_keys"][user][dev] = "signed_curve25519";
+            } catch (const exception& e) {
+                logger.warn("prefetch_device_keys_invalid",
+                            {{"user_id", user}, {"device_id", dev}, {"what", e.what()}});
+            }
+        }
+
+        if (missing.empty()) {
+            return 0;
+        }
+
+        string claim_string = claim.dump();
+        APIWrapper::matrAPIRet claimed =
+            callAPI(Op::ClaimKeys, [&] { return wrapper->claimKeys(claim_string); });
+        if (get<1>(claimed) || get<0>(claimed).empty()) {
+            return 0;
+        }
+
+        json otks = json::parse(get<0>(claimed))["one_time_keys"][user];
+        for (auto it = otks.begin(); it != otks.end(); ++it) {
+            if (missing.count(it.key()) == 0 || it.value().empty()) {
+                continue;
+            }
+            ++num_claimed;
+
+            // A malformed key only costs the session with that device
+            try {
+                string curve_key = missing[it.key()].first;
+                string ed_key    = missing[it.key()].second;
+                json signed_key  = it.value().begin().value();
+
+                {
+                    Metrics::Timer timer(metrics, Op::Verify);
+                    if (!OlmWrapper::utils::verify(signed_key, ed_key)) {
+                        timer.fail();
+                        continue;
+                    }
+                }
+
+                string otk = signed_key["key"];
+                shared_ptr<OlmSession> session(olm_session(new uint8_t[olm_session_size()]),
+                                               OlmWrapper::utils::OlmDeleter());
+                int random_size = olm_create_outbound_session_random_length(session.get());
+                unique_ptr<uint8_t[]> random = getRandData(random_size);
+                size_t created;
+                {
+                    lock_guard<mutex> lock(acct_mtx);
+                    created = olm_create_outbound_session(session.get(), acct.get(),
+                                                          curve_key.data(), curve_key.size(),
+                                                          otk.data(), otk.size(), random.get(),
+                                                          random_size);
+                }
+                if (olm_error() != created) {
+                    lock_guard<mutex> lock(sessions_mtx);
+                    sessions.emplace(curve_key, session);
+                    metrics.sessions_prefetched.inc();
+                } else {
+                    logger.warn("prefetch_session_creation_failed",
+                                {{"user_id", user},
+                                 {"device_id", it.key()},
+                                 {"what", olm_session_last_error(session.get())}});
+                }
+            } catch (const exception& e) {
+                logger.warn("prefetch_claimed_key_invalid",
+                            {{"user_id", user}, {"device_id", it.key()}, {"what", e.what()}});
+            }
+        }
+        return num_claimed;
+    } catch (const exception& e) {
+        logger.error("session_prefetch_failed", {{"user_id", user}, {"what", e.what()}});
+        return num_claimed;
+    }
+}
+
+bool MatrixOlmWrapper::replayKey(const string& secured_message,
+                                 OlmWrapper::ReplayCache::Digest& key) {
+    try {
+        json event   = json::parse(secured_message);
+        json content = event.count("content") > 0 ? event["content"] : event;
+        string algorithm = content["algorithm"];
+
+        if (algorithm == "m.megolm.v1.aes-sha2") {
+            uint32_t index;
+            if (!getMegolmMessageIndex(content["ciphertext"].get<string>(), index)) {
+                return false;
+            }
+            key = OlmWrapper::ReplayCache::megolmKey(content["session_id"], index);
+            return true;
+        } else if (algorithm == "m.olm.v1.curve25519-aes-sha2") {
+            // Only the ciphertext addressed to this device matters
+            string our_key;
+            {
+                lock_guard<mutex> lock(identity_mtx);
+                our_key = curve25519_key;
+            }
+            if (our_key.empty() || content["ciphertext"].count(our_key) == 0) {
+                return false;
+            }
+            key = OlmWrapper::ReplayCache::olmKey(content["sender_key"],
+                                                  content["ciphertext"][our_key]["body"]);
+            return true;
+        }
+        return false;
+    } catch (const exception& e) {
+        logger.warn("replay_key_failed", {{"what", e.what()}});
+        return false;
+    }
+}
+
 void MatrixOlmWrapper::setupIdentityKeys() {
     if (!id_published) {
-        if (identity_keys.empty()) {
-            int id_buff_size = olm_account_identity_keys_length(acct.get());
-            unique_ptr<uint8_t[]> id_buff(new uint8_t[id_buff_size]);
-            if (olm_error() != olm_account_identity_keys(acct.get(), id_buff.get(), id_buff_size)) {
-                identity_keys = string(reinterpret_cast<const char*>(id_buff.get()));
-            } else {
-                // Couldnt get the identity keys
+        string keys = getIdentityKeys();
+        if (keys.empty()) {
+            {
+                lock_guard<mutex> lock(acct_mtx);
+                size_t id_buff_size = olm_account_identity_keys_length(acct.get());
+                unique_ptr<uint8_t[]> id_buff(new uint8_t[id_buff_size]);
+                size_t id_len = olm_account_identity_keys(acct.get(), id_buff.get(), id_buff_size);
+                if (olm_error() == id_len) {
+                    // Couldnt get the identity keys
+                    return;
+                }
+                // olm doesn't NUL terminate the keys
+                keys = string(reinterpret_cast<const char*>(id_buff.get()), id_len);
+            }
+
+            // Parsed once here so replay checks needn't parse it per event
+            string curve_key;
+            try {
+                curve_key = json::parse(keys)["curve25519"];
+            } catch (const exception& e) {
+                logger.error("identity_key_setup_failed", {{"what", e.what()}});
                 return;
             }
+            lock_guard<mutex> lock(identity_mtx);
+            identity_keys  = keys;
+            curve25519_key = curve_key;
         }
 
         // Form json and publish keys
-        if (!identity_keys.empty()) {
+        if (!keys.empty()) {
             try {
-                json id       = json::parse(identity_keys);
+                json id       = json::parse(keys);
                 json key_data = {
                     {"algorithms", {"m.olm.v1.curve25519-aes-sha2", "m.megolm.v1.aes-sha2"}},
                     {"keys",
@@ -66,21 +305,29 @@ void MatrixOlmWrapper::setupIdentityKeys() {
                     {"user_id", user_id}};
 
                 // Sign keyData
-                string sig = OlmWrapper::utils::signData(key_data, acct);
+                string sig;
+                {
+                    Metrics::Timer timer(metrics, Op::Sign);
+                    lock_guard<mutex> lock(acct_mtx);
+                    sig = OlmWrapper::utils::signData(key_data, acct);
+                    if (sig.empty()) {
+                        timer.fail();
+                    }
+                }
                 key_data["signatures"][user_id]["ed25519:" + device_id] = sig;
 
                 // Upload keys
-                string key_string                       = key_data.dump();
-                APIWrapper::matrAPIRet individKeyUpload = wrapper->uploadKeys(key_string);
-                auto err                                = get<1>(individKeyUpload);
+                string key_string = key_data.dump();
+                APIWrapper::matrAPIRet individKeyUpload =
+                    callAPI(Op::UploadKeys, [&] { return wrapper->uploadKeys(key_string); });
+                auto err = get<1>(individKeyUpload);
                 if (!err) {
                     id_published = true;
                     // Add our keys to our list of verified devices
-                    verified[user_id][device_id] = id["ed25519"].get<string>();
+                    verifyDevice(user_id, device_id, id["ed25519"].get<string>());
                 }
             } catch (const exception& e) {
-                cout << "Encountered an issue during identity key setup: " << endl
-                     << e.what() << endl;
+                logger.error("identity_key_setup_failed", {{"what", e.what()}});
                 return;
             }
         }
@@ -95,8 +342,13 @@ void MatrixOlmWrapper::setupIdentityKeys() {
 json MatrixOlmWrapper::signKey(json& key) {
     json to_sign, signed_key;
     try {
-        to_sign["key"]   = key.begin().value();
-        string signature = signData(to_sign, acct);
+        to_sign["key"] = key.begin().value();
+        Metrics::Timer timer(metrics, Op::Sign);
+        string signature;
+        {
+            lock_guard<mutex> lock(acct_mtx);
+            signature = signData(to_sign, acct);
+        }
         if (!signature.empty()) {
             signed_key = {{"signed_curve25519:" + key.begin().key(),
                            {{to_sign.begin().key(), to_sign.begin().value()},
@@ -104,10 +356,11 @@ json MatrixOlmWrapper::signKey(json& key) {
             return signed_key;
         } else {
             // Couldnt sign properly, return nullptr to signify this
+            timer.fail();
             return nullptr;
         }
     } catch (const exception& e) {
-        cout << "Encountered an issue during key signing: " << endl << e.what() << endl;
+        logger.error("key_signing_failed", {{"what", e.what()}});
         return nullptr;
     }
 }
@@ -119,6 +372,7 @@ json MatrixOlmWrapper::signKey(json& key) {
  * will be returned
  */
 int MatrixOlmWrapper::genSignedKeys(json& data, int num_keys) {
+    unique_lock<mutex> lock(acct_mtx);
     int rand_length = olm_account_generate_one_time_keys_random_length(acct.get(), num_keys);
     unique_ptr<uint8_t[]> rand_data = getRandData(rand_length);
     json original_data              = data;
@@ -127,9 +381,13 @@ int MatrixOlmWrapper::genSignedKeys(json& data, int num_keys) {
                                                               rand_length)) {
             int keys_size = olm_account_one_time_keys_length(acct.get());
             unique_ptr<uint8_t[]> keys(new uint8_t[keys_size]);
-            if (olm_error() != olm_account_one_time_keys(acct.get(), keys.get(), keys_size)) {
-                json one_time_keys = json::parse(string(reinterpret_cast<const char*>(keys.get())));
+            size_t keys_len = olm_account_one_time_keys(acct.get(), keys.get(), keys_size);
+            if (olm_error() != keys_len) {
+                json one_time_keys =
+                    json::parse(string(reinterpret_cast<const char*>(keys.get()), keys_len));
                 json signed_key;
+                // signKey takes the account lock itself
+                lock.unlock();
 
                 for (auto it = one_time_keys["curve25519"].begin();
                      it != one_time_keys["curve25519"].end(); ++it) {
@@ -154,7 +412,7 @@ int MatrixOlmWrapper::genSignedKeys(json& data, int num_keys) {
             return 0;
         }
     } catch (const exception& e) {
-        cout << "Encountered an issue during signed key generation: " << endl << e.what() << endl;
+        logger.error("signed_key_generation_failed", {{"what", e.what()}});
         data = original_data;
         return 0;
     }
@@ -164,17 +422,23 @@ int MatrixOlmWrapper::genSignedKeys(json& data, int num_keys) {
 void MatrixOlmWrapper::replenishKeyJob() {
     try {
         // Call upload keys to figure out how many keys are present
-        string empty                    = "{}";
-        APIWrapper::matrAPIRet keyCount = wrapper->uploadKeys(empty);
-        string key_counts               = get<0>(keyCount);
-        int current_key_count           = 0;
+        string empty = "{}";
+        APIWrapper::matrAPIRet keyCount =
+            callAPI(Op::UploadKeys, [&] { return wrapper->uploadKeys(empty); });
+        string key_counts     = get<0>(keyCount);
+        int current_key_count = 0;
         if (!key_counts.empty() && json::parse(key_counts).count("one_time_key_counts") == 1) {
             current_key_count =
                 json::parse(key_counts)["one_time_key_counts"]["signed_curve25519"].get<int>();
         }
+        metrics.one_time_keys.set(current_key_count);
 
-        int keys_needed = static_cast<int>(olm_account_max_number_of_one_time_keys(acct.get())) -
-                          current_key_count;
+        int max_keys;
+        {
+            lock_guard<mutex> lock(acct_mtx);
+            max_keys = static_cast<int>(olm_account_max_number_of_one_time_keys(acct.get()));
+        }
+        int keys_needed = max_keys - current_key_count;
 
         if (keys_needed) {
             json data;
@@ -182,20 +446,24 @@ void MatrixOlmWrapper::replenishKeyJob() {
                 // Simple test below to show how verify works
                 json check_sig(data["one_time_keys"].begin().value());
 
-                string data_string                   = data.dump(2);
-                APIWrapper::matrAPIRet massKeyUpload = wrapper->uploadKeys(data_string);
-                string resp                          = get<0>(massKeyUpload);
-                auto err                             = get<1>(massKeyUpload);
+                string data_string = data.dump(2);
+                APIWrapper::matrAPIRet massKeyUpload =
+                    callAPI(Op::UploadKeys, [&] { return wrapper->uploadKeys(data_string); });
+                string resp = get<0>(massKeyUpload);
+                auto err    = get<1>(massKeyUpload);
                 if (!err) {
-                    if (json::parse(resp)["one_time_key_counts"]["signed_curve25519"].get<int>() >
-                        current_key_count) {
+                    int new_key_count =
+                        json::parse(resp)["one_time_key_counts"]["signed_curve25519"].get<int>();
+                    metrics.one_time_keys.set(new_key_count);
+                    if (new_key_count > current_key_count) {
+                        lock_guard<mutex> lock(acct_mtx);
                         olm_account_mark_keys_as_published(acct.get());
                     }
                 }
             }
         }
     } catch (const exception& e) {
-        cout << "Encountered an issue during key replenishment: " << endl << e.what() << endl;
+        logger.error("key_replenishment_failed", {{"what", e.what()}});
         return;
     }
 }
@@ -207,17 +475,19 @@ shared_ptr<OlmAccount> MatrixOlmWrapper::loadAccount(string keyfile_path, string
         int random_size              = olm_create_account_random_length(acct.get());
         unique_ptr<uint8_t[]> random = getRandData(random_size);
         if (olm_error() != olm_create_account(acct.get(), random.get(), random_size)) {
-            thread([this]() {
-                while (true) {
+            key_thread = thread([this]() {
+                unique_lock<mutex> lock(key_thread_mtx);
+                while (!stopping) {
+                    lock.unlock();
                     setupIdentityKeys();
                     if (id_published) {
                         replenishKeyJob();
                     }
-                    this_thread::sleep_for(chrono::minutes(10));
-                    // this_thread::sleep_for(chrono::seconds(1));
+                    lock.lock();
+                    key_thread_wake.wait_for(lock, chrono::minutes(10),
+                                             [this]() { return stopping; });
                 }
-            })
-                .detach();
+            });
 
             return acct;
         } else {
@@ -1,16 +1,26 @@
 #ifndef MATRIX_OLM_WRAPPER
 #define MATRIX_OLM_WRAPPER
 
+#include <condition_variable>
 #include <experimental/optional>
 #include <functional>
 #include <iostream>
 #include <memory>
+#include <mutex>
+#include <thread>
 #include <tuple>
+#include <vector>
 
 #include <json.hpp>
 #include <olm/olm.h>
 
 #include "APIWrapper.hpp"
+#include "GroupSessionStore.hpp"
+#include "KeyExport.hpp"
+#include "Logger.hpp"
+#include "Metrics.hpp"
+#include "ReplayCache.hpp"
+#include "SessionPrefetcher.hpp"
 
 using json = nlohmann::json;
 using namespace std;
@@ -29,8 +39,12 @@ class MatrixOlmWrapper {
         wrapper   = wrapper_;
         device_id = device_id_;
         user_id   = user_id_;
-        acct      = loadAccount(keyfile_path, keyfile_pass);
+        // Held so the key thread started by loadAccount waits for acct
+        lock_guard<mutex> lock(acct_mtx);
+        acct = loadAccount(keyfile_path, keyfile_pass);
     }
+    // Stops the key thread, waiting for any upload in progress to finish
+    ~MatrixOlmWrapper();
 
     // The signAndEncrypt, decryptAndVerify, and verifyDevice functions should be
     // called by the client when sending and receiving messages. Provided string
@@ -49,20 +63,80 @@ class MatrixOlmWrapper {
     // client can choose what to do with the unverified message
     APIRet decryptAndVerify(const string& secured_message);
 
+    // Claims secured_message, an m.room.encrypted event or its content, for processing. Returns
+    // false if it was already claimed, in which case it is a duplicate and should be dropped.
+    // Sync redelivers to_device events on reconnect, so this should be called before any
+    // decryption is attempted. The check and the claim happen atomically, so only one of
+    // several threads handed the same event will process it.
+    bool claimMessage(const string& secured_message);
+    // Gives up a claim taken by claimMessage. Call this if decryption fails so a later
+    // redelivery of the message may be retried.
+    void releaseMessage(const string& secured_message);
+
     // Adds a user_id-><device_id,pub_key> to the list of verified devices
     void verifyDevice(const string& user_id, const string& device_id, const string& key) {
+        lock_guard<mutex> lock(verified_mtx);
         verified[user_id][device_id] = key;
     }
 
     string getUserDeviceKey(const string& user_id, const string& device_id) {
-        if (verified.find(user_id) != verified.end() &&
-            verified[user_id].find(device_id) != verified[user_id].end()) {
-            return verified[user_id][device_id];
-        } else {
-            return "";
+        lock_guard<mutex> lock(verified_mtx);
+        auto user = verified.find(user_id);
+        if (user != verified.end()) {
+            auto device = user->second.find(device_id);
+            if (device != user->second.end()) {
+                return device->second;
+            }
+        }
+        return "";
+    }
+
+    // Starts establishing olm sessions in the background with the devices of
+    // peers which are messaged often, or which the client hints at, so the
+    // first message to them doesn't wait on claiming one-time keys. Sessions
+    // are only created for devices which don't have one yet.
+    void enableSessionPrefetch(OlmWrapper::PrefetchConfig config = OlmWrapper::PrefetchConfig());
+
+    // Records that a message was sent to user_id, used to find frequently
+    // contacted peers. Does nothing unless prefetching is enabled.
+    void noteMessageSent(const string& user_id) {
+        if (prefetcher) {
+            prefetcher->recordSend(user_id);
+        }
+    }
+
+    // Hints that the given users are likely to be messaged soon, e.g. the
+    // members of a room which just became active. Does nothing unless
+    // prefetching is enabled.
+    void hintActivePeers(const vector<string>& user_ids) {
+        if (prefetcher) {
+            prefetcher->hint(user_ids);
         }
     }
 
+    // Writes every inbound group session to out in the Matrix key export
+    // format, encrypted with passphrase. Returns an error on failure.
+    wrapperError exportRoomKeys(const string& passphrase, ostream& out) {
+        return OlmWrapper::exportRoomKeys(group_sessions, passphrase, out);
+    }
+
+    // Loads the sessions from a Matrix key export into group_sessions,
+    // returning the number of sessions added
+    tuple<size_t, wrapperError> importRoomKeys(const string& passphrase, istream& in) {
+        return OlmWrapper::importRoomKeys(group_sessions, passphrase, in);
+    }
+
+    // Returns the device's identity keys as json, or an empty string until the
+    // key thread has read them from the account
+    string getIdentityKeys() {
+        lock_guard<mutex> lock(identity_mtx);
+        return identity_keys;
+    }
+
+    // Hands a snapshot of the current metrics to the given sink, e.g. a
+    // PrometheusTextSink writing to a scrape endpoint
+    void exportMetrics(OlmWrapper::MetricsSink& sink) const { metrics.exportTo(sink); }
+
     public:
     // Public Variables
 
@@ -77,9 +151,22 @@ class MatrixOlmWrapper {
     // to
     string user_id;
 
-    // Identity keys used to identify the device and verify its signatures
+    // Identity keys used to identify the device and verify its signatures.
+    // Written by the key thread, so read it through getIdentityKeys.
     string identity_keys;
 
+    // Inbound megolm sessions used to decrypt room messages
+    OlmWrapper::GroupSessionStore group_sessions;
+
+    // Call counts, error counts and latencies of homeserver requests and
+    // crypto operations performed by this wrapper
+    OlmWrapper::Metrics metrics;
+
+    // Structured, rate limited logger used to report failures. Use
+    // logger.setSink to redirect records away from stderr.
+    OlmWrapper::Logger logger{OlmWrapper::Logger::stderrSink, 1.0, 5,
+                              &metrics.log_messages_suppressed};
+
     private:
     // Private Functions
 
@@ -88,6 +175,29 @@ class MatrixOlmWrapper {
     // should be persisted to disk.
     shared_ptr<OlmAccount> loadAccount(string keyfile_path, string keyfile_pass);
 
+    // Calls into the client's APIWrapper, recording the call against op
+    template <typename F> APIWrapper::matrAPIRet callAPI(OlmWrapper::Op op, F&& request) {
+        OlmWrapper::Metrics::Timer timer(metrics, op);
+        APIWrapper::matrAPIRet ret = request();
+        if (get<1>(ret)) {
+            timer.fail();
+        }
+        return ret;
+    }
+
+    // Derives the replay cache key of an encrypted event, returning false if
+    // the event is not one the cache understands
+    bool replayKey(const string& secured_message, OlmWrapper::ReplayCache::Digest& key);
+
+    // Returns true if there is an open session with the device owning
+    // curve_key, counting the check in the prefetch metrics
+    bool hasSession(const string& curve_key);
+
+    // Creates outbound sessions with the devices of user_id which have none
+    // yet, claiming at most max_claims one-time keys. Returns the number of
+    // one-time keys claimed.
+    size_t prefetchSessions(const string& user_id, size_t max_claims);
+
     bool verify(json& message);
     json signKey(json& key);
     int genSignedKeys(json& data, int num_keys);
@@ -99,18 +209,45 @@ class MatrixOlmWrapper {
 
     // Account used to interact with olm, and store keys.
     shared_ptr<OlmAccount> acct;
+    // Serializes use of acct between the key thread, the prefetcher and
+    // client calls, as olm accounts aren't thread safe
+    mutex acct_mtx;
 
     // Keeps track of verified devices
     // hashmap(user_id -> hashmap(device_id -> Base64_fingerprint_key))
     unordered_map<string, unordered_map<string, string>> verified;
+    // Guards verified, which the prefetcher reads from its own thread
+    mutex verified_mtx;
 
     // Keeps track of open sessions
     // hashmap(identity_key -> Session)
     unordered_map<string, shared_ptr<OlmSession>> sessions;
+    // Guards sessions, which the prefetcher fills from its own thread
+    mutex sessions_mtx;
+
+    // Our curve25519 key, taken from identity_keys when they're first read
+    string curve25519_key;
+    // Guards identity_keys and curve25519_key, which the key thread sets
+    mutex identity_mtx;
+
+    // Digests of encrypted messages which have already been processed
+    OlmWrapper::ReplayCache replay_cache;
 
     // Indicates whether or not, data is being persisted to disk
     bool persisting;
     // Indicating whether or not identity_keys_ has been published
-    bool id_published;
+    bool id_published = false;
+
+    // Publishes our identity keys and keeps the one-time keys topped up
+    thread key_thread;
+    // Wakes the key thread early when the wrapper is destroyed
+    mutex key_thread_mtx;
+    condition_variable key_thread_wake;
+    bool stopping = false;
+
+    // Establishes sessions ahead of the first message, null unless enabled.
+    // Declared last so its thread is stopped before anything it uses is
+    // destroyed.
+    unique_ptr<OlmWrapper::SessionPrefetcher> prefetcher;
 };
 #endif
\ No newline at end of file
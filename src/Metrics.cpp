@@ -0,0 +1,134 @@
+#include "Metrics.hpp"
+
+#include <algorithm>
+
+namespace OlmWrapper {
+
+const char* opName(Op op) {
+    switch (op) {
+    case Op::UploadKeys:
+        return "upload_keys";
+    case Op::QueryKeys:
+        return "query_keys";
+    case Op::ClaimKeys:
+        return "claim_keys";
+    case Op::GetKeyChanges:
+        return "get_key_changes";
+    case Op::PromptVerifyDevice:
+        return "prompt_verify_device";
+    case Op::Sign:
+        return "sign";
+    case Op::Verify:
+        return "verify";
+    case Op::Encrypt:
+        return "encrypt";
+    case Op::Decrypt:
+        return "decrypt";
+    default:
+        return "unknown";
+    }
+}
+
+void Histogram::observe(uint64_t micros) {
+    size_t idx = lower_bound(bounds.begin(), bounds.end(), micros) - bounds.begin();
+    buckets[idx].fetch_add(1, memory_order_relaxed);
+    sum_us.fetch_add(micros, memory_order_relaxed);
+    total.fetch_add(1, memory_order_relaxed);
+}
+
+array<uint64_t, Histogram::bounds.size() + 1> Histogram::bucketCounts() const {
+    array<uint64_t, bounds.size() + 1> counts;
+    for (size_t i = 0; i < counts.size(); ++i) {
+        counts[i] = buckets[i].load(memory_order_relaxed);
+    }
+    return counts;
+}
+
+Metrics::Timer::~Timer() {
+    auto elapsed =
+        chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start).count();
+    stats.calls.inc();
+    if (failed || uncaught_exceptions() > exceptions) {
+        stats.errors.inc();
+    }
+    stats.latency.observe(static_cast<uint64_t>(elapsed));
+}
+
+MetricsSnapshot Metrics::snapshot() const {
+    MetricsSnapshot snap;
+    for (size_t i = 0; i < ops.size(); ++i) {
+        const OpStats& stats = ops[i];
+        MetricsSnapshot::OpSnapshot op_snap;
+        op_snap.name   = opName(static_cast<Op>(i));
+        op_snap.calls  = stats.calls.get();
+        op_snap.errors = stats.errors.get();
+
+        // Exporters expect cumulative buckets
+        auto counts      = stats.latency.bucketCounts();
+        uint64_t running = 0;
+        for (size_t b = 0; b < counts.size(); ++b) {
+            running += counts[b];
+            op_snap.latency_buckets[b] = running;
+        }
+        op_snap.latency_count  = stats.latency.count();
+        op_snap.latency_sum_us = stats.latency.sum();
+        snap.ops.push_back(op_snap);
+    }
+
+    snap.one_time_keys             = one_time_keys.get();
+    snap.prefetch_sessions_present = prefetch_sessions_present.get();
+    snap.prefetch_sessions_missing = prefetch_sessions_missing.get();
+    snap.sessions_prefetched       = sessions_prefetched.get();
+    snap.replayed_messages         = replayed_messages.get();
+    snap.log_messages_suppressed   = log_messages_suppressed.get();
+    return snap;
+}
+
+void PrometheusTextSink::write(const MetricsSnapshot& snapshot) {
+    const string prefix = "matrix_olm_wrapper_";
+
+    out << "# TYPE " << prefix << "op_calls_total counter\n";
+    for (auto& op : snapshot.ops) {
+        out << prefix << "op_calls_total{op=\"" << op.name << "\"} " << op.calls << "\n";
+    }
+
+    out << "# TYPE " << prefix << "op_errors_total counter\n";
+    for (auto& op : snapshot.ops) {
+        out << prefix << "op_errors_total{op=\"" << op.name << "\"} " << op.errors << "\n";
+    }
+
+    out << "# TYPE " << prefix << "op_latency_seconds histogram\n";
+    for (auto& op : snapshot.ops) {
+        for (size_t b = 0; b < op.latency_buckets.size(); ++b) {
+            out << prefix << "op_latency_seconds_bucket{op=\"" << op.name << "\",le=\"";
+            if (b < Histogram::bounds.size()) {
+                out << Histogram::bounds[b] / 1e6;
+            } else {
+                out << "+Inf";
+            }
+            out << "\"} " << op.latency_buckets[b] << "\n";
+        }
+        out << prefix << "op_latency_seconds_sum{op=\"" << op.name << "\"} "
+            << op.latency_sum_us / 1e6 << "\n";
+        out << prefix << "op_latency_seconds_count{op=\"" << op.name << "\"} "
+            << op.latency_count << "\n";
+    }
+
+    out << "# TYPE " << prefix << "one_time_keys gauge\n"
+        << prefix << "one_time_keys " << snapshot.one_time_keys << "\n";
+    out << "# TYPE " << prefix << "prefetch_sessions_present_total counter\n"
+        << prefix << "prefetch_sessions_present_total " << snapshot.prefetch_sessions_present
+        << "\n";
+    out << "# TYPE " << prefix << "prefetch_sessions_missing_total counter\n"
+        << prefix << "prefetch_sessions_missing_total " << snapshot.prefetch_sessions_missing
+        << "\n";
+    out << "# TYPE " << prefix << "sessions_prefetched_total counter\n"
+        << prefix << "sessions_prefetched_total " << snapshot.sessions_prefetched << "\n";
+    out << "# TYPE " << prefix << "replayed_messages_total counter\n"
+        << prefix << "replayed_messages_total " << snapshot.replayed_messages << "\n";
+    out << "# TYPE " << prefix << "log_messages_suppressed_total counter\n"
+        << prefix << "log_messages_suppressed_total " << snapshot.log_messages_suppressed
+        << "\n";
+    out.flush();
+}
+}
@@ -0,0 +1,186 @@
+#ifndef METRICS
+#define METRICS
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <ostream>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+namespace OlmWrapper {
+
+// Operations whose call counts, error counts and latencies are tracked
+enum class Op {
+    UploadKeys,
+    QueryKeys,
+    ClaimKeys,
+    GetKeyChanges,
+    PromptVerifyDevice,
+    Sign,
+    Verify,
+    Encrypt,
+    Decrypt,
+    NumOps
+};
+
+// Returns the snake_case name used for op when exporting
+const char* opName(Op op);
+
+// Monotonically increasing count. All updates are relaxed atomics so they are
+// safe to make from any thread without taking a lock.
+class Counter {
+    public:
+    void inc(uint64_t n = 1) { value.fetch_add(n, memory_order_relaxed); }
+    uint64_t get() const { return value.load(memory_order_relaxed); }
+
+    private:
+    atomic<uint64_t> value{0};
+};
+
+// Point in time value which may go up or down
+class Gauge {
+    public:
+    void set(int64_t v) { value.store(v, memory_order_relaxed); }
+    void add(int64_t n) { value.fetch_add(n, memory_order_relaxed); }
+    int64_t get() const { return value.load(memory_order_relaxed); }
+
+    private:
+    atomic<int64_t> value{0};
+};
+
+// Fixed bucket latency histogram, recorded in microseconds
+class Histogram {
+    public:
+    // Inclusive upper bound of each bucket in microseconds. Anything larger
+    // than the last bound lands in the implicit +Inf bucket.
+    static constexpr array<uint64_t, 16> bounds = {
+        {50, 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000,
+         1000000, 2500000, 10000000}};
+
+    void observe(uint64_t micros);
+
+    // Per bucket (non-cumulative) counts, the last entry being +Inf
+    array<uint64_t, bounds.size() + 1> bucketCounts() const;
+    uint64_t count() const { return total.load(memory_order_relaxed); }
+    uint64_t sum() const { return sum_us.load(memory_order_relaxed); }
+
+    private:
+    array<atomic<uint64_t>, bounds.size() + 1> buckets{};
+    atomic<uint64_t> total{0};
+    atomic<uint64_t> sum_us{0};
+};
+
+// Stats kept for every Op
+struct OpStats {
+    Counter calls;
+    Counter errors;
+    Histogram latency;
+};
+
+// Plain copy of all metrics taken at a single point in time, handed to sinks
+struct MetricsSnapshot {
+    struct OpSnapshot {
+        string name;
+        uint64_t calls;
+        uint64_t errors;
+        // Cumulative count of observations <= bounds[i], the last entry being +Inf
+        array<uint64_t, Histogram::bounds.size() + 1> latency_buckets;
+        uint64_t latency_count;
+        uint64_t latency_sum_us;
+    };
+
+    vector<OpSnapshot> ops;
+    int64_t one_time_keys;
+    uint64_t prefetch_sessions_present;
+    uint64_t prefetch_sessions_missing;
+    uint64_t sessions_prefetched;
+    uint64_t replayed_messages;
+    uint64_t log_messages_suppressed;
+};
+
+// Destination for exported metrics. Implement this to forward metrics to a
+// monitoring system of choice.
+class MetricsSink {
+    public:
+    virtual void write(const MetricsSnapshot& snapshot) = 0;
+    virtual ~MetricsSink() {}
+};
+
+// Renders metrics in the Prometheus text exposition format to the given stream
+class PrometheusTextSink : public MetricsSink {
+    public:
+    explicit PrometheusTextSink(ostream& out_) : out(out_) {}
+    virtual void write(const MetricsSnapshot& snapshot);
+
+    private:
+    ostream& out;
+};
+
+// Hands every snapshot to a caller provided function
+class CallbackSink : public MetricsSink {
+    public:
+    explicit CallbackSink(function<void(const MetricsSnapshot&)> cb_) : cb(move(cb_)) {}
+    virtual void write(const MetricsSnapshot& snapshot) { cb(snapshot); }
+
+    private:
+    function<void(const MetricsSnapshot&)> cb;
+};
+
+class Metrics {
+    public:
+    OpStats& op(Op o) { return ops[static_cast<size_t>(o)]; }
+    const OpStats& op(Op o) const { return ops[static_cast<size_t>(o)]; }
+
+    MetricsSnapshot snapshot() const;
+    void exportTo(MetricsSink& sink) const { sink.write(snapshot()); }
+
+    // Times the enclosing scope and records it against an Op on destruction.
+    // Call fail() if the operation did not succeed. Leaving the scope through
+    // an exception is counted as a failure as well.
+    class Timer {
+        public:
+        Timer(Metrics& m, Op o)
+            : stats(m.op(o)), start(chrono::steady_clock::now()),
+              exceptions(uncaught_exceptions()) {}
+        Timer(const Timer&) = delete;
+        Timer& operator=(const Timer&) = delete;
+        ~Timer();
+
+        void fail() { failed = true; }
+
+        private:
+        OpStats& stats;
+        chrono::steady_clock::time_point start;
+        int exceptions;
+        bool failed = false;
+    };
+
+    public:
+    // Number of signed one-time keys the homeserver reports it holds for us
+    Gauge one_time_keys;
+
+    // Devices the prefetcher found to have, or to lack, an olm session when
+    // deciding which one-time keys to claim
+    Counter prefetch_sessions_present;
+    Counter prefetch_sessions_missing;
+
+    // Outbound sessions established ahead of the first message
+    Counter sessions_prefetched;
+
+    // Incoming messages dropped because they had already been processed
+    Counter replayed_messages;
+
+    // Log records dropped by the rate limiter
+    Counter log_messages_suppressed;
+
+    private:
+    array<OpStats, static_cast<size_t>(Op::NumOps)> ops;
+};
+}
+#endif
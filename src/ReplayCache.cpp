@@ -0,0 +1,113 @@
+#include "ReplayCache.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+#include <sodium.h>
+
+namespace OlmWrapper {
+
+// Hashes the given parts, each followed by a NUL separator, into a digest
+static ReplayCache::Digest digestOf(initializer_list<pair<const void*, size_t>> parts) {
+    crypto_hash_sha256_state state;
+    crypto_hash_sha256_init(&state);
+    const unsigned char sep = 0;
+    for (auto& part : parts) {
+        crypto_hash_sha256_update(&state, static_cast<const unsigned char*>(part.first),
+                                  part.second);
+        crypto_hash_sha256_update(&state, &sep, 1);
+    }
+
+    unsigned char hash[crypto_hash_sha256_BYTES];
+    crypto_hash_sha256_final(&state, hash);
+
+    ReplayCache::Digest d;
+    memcpy(&d.hi, hash, sizeof(d.hi));
+    memcpy(&d.lo, hash + sizeof(d.hi), sizeof(d.lo));
+    return d;
+}
+
+ReplayCache::Digest ReplayCache::olmKey(const string& sender_key, const string& ciphertext) {
+    static const char domain[] = "m.olm";
+    return digestOf({{domain, sizeof(domain) - 1},
+                     {sender_key.data(), sender_key.size()},
+                     {ciphertext.data(), ciphertext.size()}});
+}
+
+ReplayCache::Digest ReplayCache::megolmKey(const string& session_id, uint32_t message_index) {
+    static const char domain[] = "m.megolm";
+    unsigned char index[4] = {
+        static_cast<unsigned char>(message_index >> 24),
+        static_cast<unsigned char>(message_index >> 16),
+        static_cast<unsigned char>(message_index >> 8), static_cast<unsigned char>(message_index)};
+    return digestOf({{domain, sizeof(domain) - 1},
+                     {session_id.data(), session_id.size()},
+                     {index, sizeof(index)}});
+}
+
+ReplayCache::ReplayCache(size_t capacity)
+    : generation_capacity(max<size_t>(capacity / 2, 1)),
+      current(generation_capacity * bits_per_entry), previous(generation_capacity * bits_per_entry) {
+    current.exact.reserve(generation_capacity);
+}
+
+bool ReplayCache::mayContain(const Generation& gen, const Digest& key) const {
+    uint64_t num_bits = gen.bloom.size() * 64;
+    for (unsigned i = 0; i < num_hashes; ++i) {
+        uint64_t bit = (key.hi + i * key.lo) % num_bits;
+        if (!(gen.bloom[bit / 64] & (uint64_t(1) << (bit % 64)))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool ReplayCache::containsLocked(const Digest& key) const {
+    return (mayContain(current, key) && current.exact.count(key) > 0) ||
+           (mayContain(previous, key) && previous.exact.count(key) > 0);
+}
+
+void ReplayCache::insertLocked(const Digest& key) {
+    if (current.exact.size() >= generation_capacity) {
+        // Slide the window, forgetting the oldest generation
+        swap(previous, current);
+        fill(current.bloom.begin(), current.bloom.end(), 0);
+        current.exact.clear();
+    }
+
+    uint64_t num_bits = current.bloom.size() * 64;
+    for (unsigned i = 0; i < num_hashes; ++i) {
+        uint64_t bit = (key.hi + i * key.lo) % num_bits;
+        current.bloom[bit / 64] |= uint64_t(1) << (bit % 64);
+    }
+    current.exact.insert(key);
+}
+
+bool ReplayCache::contains(const Digest& key) const {
+    lock_guard<mutex> lock(mtx);
+    return containsLocked(key);
+}
+
+void ReplayCache::insert(const Digest& key) {
+    lock_guard<mutex> lock(mtx);
+    if (!containsLocked(key)) {
+        insertLocked(key);
+    }
+}
+
+bool ReplayCache::checkAndInsert(const Digest& key) {
+    lock_guard<mutex> lock(mtx);
+    if (containsLocked(key)) {
+        return true;
+    }
+    insertLocked(key);
+    return false;
+}
+
+void ReplayCache::erase(const Digest& key) {
+    // Bloom filter bits can't be cleared, but they only gate the exact sets
+    lock_guard<mutex> lock(mtx);
+    current.exact.erase(key);
+    previous.exact.erase(key);
+}
+}
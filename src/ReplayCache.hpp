@@ -0,0 +1,77 @@
+#ifndef REPLAY_CACHE
+#define REPLAY_CACHE
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+using namespace std;
+
+namespace OlmWrapper {
+
+// Remembers which incoming encrypted messages have already been processed so
+// that events redelivered by sync can be dropped before any crypto runs.
+//
+// Messages are identified by a 128 bit digest. Olm messages use
+// (sender_key, SHA-256(ciphertext)) and megolm messages use
+// (session_id, message_index). Memory is bounded by a sliding window of two
+// generations, each holding at most capacity / 2 digests. Every generation has
+// a Bloom filter in front of its exact digest set, so the common case of a new
+// message costs a handful of bit probes and only possible duplicates are
+// confirmed against the set. Once the current generation is full, the previous
+// one is dropped and the current one takes its place.
+class ReplayCache {
+    public:
+    struct Digest {
+        uint64_t hi;
+        uint64_t lo;
+
+        bool operator==(const Digest& o) const { return hi == o.hi && lo == o.lo; }
+    };
+
+    // Digest for an olm (to_device) message
+    static Digest olmKey(const string& sender_key, const string& ciphertext);
+    // Digest for a megolm (room) message
+    static Digest megolmKey(const string& session_id, uint32_t message_index);
+
+    explicit ReplayCache(size_t capacity = 100000);
+
+    // Returns true if key was seen within the window
+    bool contains(const Digest& key) const;
+    // Records key as seen
+    void insert(const Digest& key);
+    // Records key, returning true if it had already been seen
+    bool checkAndInsert(const Digest& key);
+    // Forgets key so it is no longer reported as seen
+    void erase(const Digest& key);
+
+    private:
+    struct DigestHash {
+        size_t operator()(const Digest& d) const { return static_cast<size_t>(d.lo); }
+    };
+
+    struct Generation {
+        explicit Generation(size_t bits) : bloom((bits + 63) / 64, 0) {}
+
+        vector<uint64_t> bloom;
+        unordered_set<Digest, DigestHash> exact;
+    };
+
+    // Bloom filter hash functions per digest and bits allocated per entry,
+    // which together give roughly a 1% false positive rate
+    static constexpr unsigned num_hashes = 7;
+    static constexpr unsigned bits_per_entry = 10;
+
+    bool mayContain(const Generation& gen, const Digest& key) const;
+    bool containsLocked(const Digest& key) const;
+    void insertLocked(const Digest& key);
+
+    mutable mutex mtx;
+    size_t generation_capacity;
+    Generation current;
+    Generation previous;
+};
+}
+#endif
@@ -0,0 +1,135 @@
+#include "SessionPrefetcher.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <utility>
+
+namespace OlmWrapper {
+
+void SessionPrefetcher::start() {
+    lock_guard<mutex> lock(mtx);
+    if (running) {
+        return;
+    }
+    running = true;
+    worker  = thread([this]() {
+        unique_lock<mutex> lock(mtx);
+        while (running) {
+            wake.wait_for(lock, config.poll_interval, [this]() { return !running || woken; });
+            if (!running) {
+                break;
+            }
+            woken = false;
+
+            lock.unlock();
+            runOnce();
+            lock.lock();
+        }
+    });
+}
+
+void SessionPrefetcher::stop() {
+    {
+        lock_guard<mutex> lock(mtx);
+        if (!running) {
+            return;
+        }
+        running = false;
+    }
+    wake.notify_all();
+    if (worker.joinable()) {
+        worker.join();
+    }
+}
+
+double SessionPrefetcher::decayedScore(const Peer& peer, Clock::time_point now) const {
+    double elapsed = chrono::duration<double>(now - peer.last_update).count();
+    return peer.score * exp2(-elapsed / config.half_life.count());
+}
+
+SessionPrefetcher::Peer& SessionPrefetcher::track(const string& user_id, Clock::time_point now) {
+    auto it = peers.find(user_id);
+    if (it != peers.end()) {
+        return it->second;
+    }
+
+    if (peers.size() >= config.max_tracked_peers) {
+        // Make room by forgetting whoever we're least likely to message,
+        // keeping peers with a pending hint for as long as possible
+        auto coldest = min_element(peers.begin(), peers.end(), [&](auto& a, auto& b) {
+            return make_pair(a.second.hinted, decayedScore(a.second, now)) <
+                   make_pair(b.second.hinted, decayedScore(b.second, now));
+        });
+        peers.erase(coldest);
+    }
+    return peers.emplace(user_id, Peer{0.0, false, now, now, false}).first->second;
+}
+
+void SessionPrefetcher::recordSend(const string& user_id) {
+    auto now = Clock::now();
+    lock_guard<mutex> lock(mtx);
+    Peer& peer       = track(user_id, now);
+    peer.score       = decayedScore(peer, now) + 1.0;
+    peer.last_update = now;
+}
+
+void SessionPrefetcher::hint(const vector<string>& user_ids) {
+    auto now = Clock::now();
+    {
+        lock_guard<mutex> lock(mtx);
+        for (auto& user_id : user_ids) {
+            track(user_id, now).hinted = true;
+        }
+        woken = true;
+    }
+    wake.notify_all();
+}
+
+size_t SessionPrefetcher::runOnce() {
+    auto now = Clock::now();
+
+    // Pick the peers which are due while holding the lock, but establish
+    // sessions without it since that involves round trips to the homeserver
+    vector<pair<string, size_t>> due;
+    {
+        lock_guard<mutex> lock(mtx);
+        for (auto it = budgets.begin(); it != budgets.end();) {
+            if (now - it->second.window_start >= config.budget_window) {
+                it = budgets.erase(it);
+            } else {
+                ++it;
+            }
+        }
+
+        for (auto& elem : peers) {
+            Peer& peer     = elem.second;
+            auto budget    = budgets.find(elem.first);
+            size_t claimed = budget != budgets.end() ? budget->second.claims_in_window : 0;
+
+            if ((!peer.hinted && decayedScore(peer, now) < config.threshold) ||
+                claimed >= config.max_claims_per_peer ||
+                (peer.attempted && now - peer.last_attempt < config.recheck_interval)) {
+                continue;
+            }
+
+            peer.hinted       = false;
+            peer.attempted    = true;
+            peer.last_attempt = now;
+            due.emplace_back(elem.first, config.max_claims_per_peer - claimed);
+        }
+    }
+
+    size_t total_claimed = 0;
+    for (auto& elem : due) {
+        size_t claimed = min(establish(elem.first, elem.second), elem.second);
+        total_claimed += claimed;
+
+        if (claimed > 0) {
+            lock_guard<mutex> lock(mtx);
+            auto it = budgets.emplace(elem.first, Budget{now, 0}).first;
+            it->second.claims_in_window += claimed;
+        }
+    }
+    return total_claimed;
+}
+}
@@ -0,0 +1,102 @@
+#ifndef SESSION_PREFETCHER
+#define SESSION_PREFETCHER
+
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+using namespace std;
+
+namespace OlmWrapper {
+
+struct PrefetchConfig {
+    // Time after which a peer's send frequency score has halved
+    chrono::seconds half_life{600};
+    // Score a peer needs before sessions are prefetched for it. Every message
+    // sent adds one to the score.
+    double threshold = 3.0;
+    // Most one-time keys which may be claimed from a single peer within
+    // budget_window, so prefetching never drains another user's key pool
+    size_t max_claims_per_peer = 5;
+    chrono::seconds budget_window{3600};
+    // Minimum time between two prefetch attempts for the same peer
+    chrono::seconds recheck_interval{600};
+    // How often the background thread looks for peers to prefetch when it
+    // isn't woken up by a hint
+    chrono::seconds poll_interval{30};
+    // Bound on the number of peers tracked, the lowest scoring are dropped
+    size_t max_tracked_peers = 1024;
+};
+
+// Decides which peers are worth establishing olm sessions with ahead of the
+// first message and drives the work from a background thread.
+//
+// The work itself is done by the establish function passed in, which is
+// handed a user_id and the number of one-time keys it may still claim from
+// that user, and returns how many it actually claimed.
+class SessionPrefetcher {
+    public:
+    using EstablishFn = function<size_t(const string& user_id, size_t max_claims)>;
+
+    SessionPrefetcher(EstablishFn establish_, PrefetchConfig config_ = PrefetchConfig())
+        : establish(move(establish_)), config(config_) {}
+    SessionPrefetcher(const SessionPrefetcher&) = delete;
+    SessionPrefetcher& operator=(const SessionPrefetcher&) = delete;
+    ~SessionPrefetcher() { stop(); }
+
+    // Starts the background thread, stop() is called on destruction
+    void start();
+    void stop();
+
+    // Records a message sent to user_id
+    void recordSend(const string& user_id);
+    // Marks the given users as likely to be messaged soon, making them due
+    // regardless of their score, and wakes the background thread
+    void hint(const vector<string>& user_ids);
+
+    // Runs establish for every peer currently due. Called periodically by the
+    // background thread, returns the number of one-time keys claimed.
+    size_t runOnce();
+
+    private:
+    using Clock = chrono::steady_clock;
+
+    struct Peer {
+        double score;
+        bool hinted;
+        Clock::time_point last_update;
+        Clock::time_point last_attempt;
+        bool attempted;
+    };
+
+    struct Budget {
+        Clock::time_point window_start;
+        size_t claims_in_window;
+    };
+
+    // Score of peer decayed to now
+    double decayedScore(const Peer& peer, Clock::time_point now) const;
+    Peer& track(const string& user_id, Clock::time_point now);
+
+    EstablishFn establish;
+    PrefetchConfig config;
+
+    mutex mtx;
+    condition_variable wake;
+    bool running = false;
+    bool woken   = false;
+    thread worker;
+    unordered_map<string, Peer> peers;
+    // One-time keys claimed per peer in the current budget window. Kept apart
+    // from peers so that forgetting a peer doesn't reset its budget. Only
+    // peers which claimed keys have an entry, and it's dropped once the
+    // window has passed.
+    unordered_map<string, Budget> budgets;
+};
+}
+#endif
@@ -0,0 +1,142 @@
+#include <cstdio>
+#include <fcntl.h>
+#include <gtest/gtest.h>
+#include <json.hpp>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "Attachment.hpp"
+
+using namespace OlmWrapper;
+
+// Returns a sink appending everything it's handed to out
+AttachmentSink appendTo(string& out) {
+    return [&out](const uint8_t* data, size_t len) {
+        out.append(reinterpret_cast<const char*>(data), len);
+    };
+}
+
+const uint8_t* bytes(const string& s) { return reinterpret_cast<const uint8_t*>(s.data()); }
+
+// Spans several chunks and ends partway through one
+string makePlaintext() {
+    string plaintext(3 * attachment_chunk_size + 42, '\0');
+    for (size_t i = 0; i < plaintext.size(); ++i) {
+        plaintext[i] = static_cast<char>(i * 31 + 7);
+    }
+    return plaintext;
+}
+
+TEST(TestAttachment, DecryptsKnownVector) {
+    json encrypted_file = {{"v", "v2"},
+                           {"key",
+                            {{"kty", "oct"},
+                             {"key_ops", {"encrypt", "decrypt"}},
+                             {"alg", "A256CTR"},
+                             {"k", "AAECAwQFBgcICQoLDA0ODxAREhMUFRYXGBkaGxwdHh8"},
+                             {"ext", true}}},
+                           {"iv", "AQIDBAUGBwgAAAAAAAAAAA"},
+                           {"hashes", {{"sha256", "5GMU9Gv1emGMJbt1SWVD6dJoReiehsqKNWSDwxJwTsM"}}}};
+    const uint8_t ciphertext[] = {35, 13, 9, 165, 94, 217, 33, 22, 224};
+
+    string plaintext;
+    ASSERT_TRUE(
+        decryptAttachment(ciphertext, sizeof(ciphertext), encrypted_file, appendTo(plaintext)));
+    ASSERT_EQ("Forty-two", plaintext);
+}
+
+TEST(TestAttachment, DescriptorFormat) {
+    string ciphertext;
+    json encrypted_file = encryptAttachment(bytes("42"), 2, appendTo(ciphertext));
+    ASSERT_EQ(2u, ciphertext.size());
+    ASSERT_EQ("v2", encrypted_file["v"].get<string>());
+    ASSERT_EQ("A256CTR", encrypted_file["key"]["alg"].get<string>());
+    ASSERT_EQ("oct", encrypted_file["key"]["kty"].get<string>());
+    ASSERT_EQ(43u, encrypted_file["key"]["k"].get<string>().size());
+    ASSERT_EQ(22u, encrypted_file["iv"].get<string>().size());
+    ASSERT_EQ(43u, encrypted_file["hashes"]["sha256"].get<string>().size());
+    ASSERT_EQ(0u, encrypted_file.count("url"));
+}
+
+TEST(TestAttachment, RoundTripFile) {
+    string plaintext = makePlaintext();
+    char path[]      = "/tmp/test_attachment_XXXXXX";
+    int fd           = mkstemp(path);
+    ASSERT_NE(-1, fd);
+    ASSERT_EQ(static_cast<ssize_t>(plaintext.size()),
+              write(fd, plaintext.data(), plaintext.size()));
+    lseek(fd, 0, SEEK_SET);
+
+    string ciphertext;
+    json encrypted_file = encryptAttachment(fd, appendTo(ciphertext));
+    close(fd);
+    ASSERT_NE(nullptr, encrypted_file);
+    ASSERT_EQ(plaintext.size(), ciphertext.size());
+    ASSERT_NE(plaintext, ciphertext);
+
+    // Rewrite the file with the ciphertext and decrypt it back
+    fd = open(path, O_RDWR | O_TRUNC);
+    ASSERT_EQ(static_cast<ssize_t>(ciphertext.size()),
+              write(fd, ciphertext.data(), ciphertext.size()));
+    lseek(fd, 0, SEEK_SET);
+    string decrypted;
+    ASSERT_TRUE(decryptAttachment(fd, encrypted_file, appendTo(decrypted)));
+    close(fd);
+    unlink(path);
+    ASSERT_EQ(plaintext, decrypted);
+}
+
+TEST(TestAttachment, RoundTripPipe) {
+    string plaintext = makePlaintext();
+    int fds[2];
+    ASSERT_EQ(0, pipe(fds));
+    thread writer([&]() {
+        ssize_t ret = write(fds[1], plaintext.data(), plaintext.size());
+        (void)ret;
+        close(fds[1]);
+    });
+
+    string ciphertext;
+    json encrypted_file = encryptAttachment(fds[0], appendTo(ciphertext));
+    writer.join();
+    close(fds[0]);
+    ASSERT_NE(nullptr, encrypted_file);
+
+    string decrypted;
+    ASSERT_TRUE(decryptAttachment(bytes(ciphertext), ciphertext.size(), encrypted_file,
+                                  appendTo(decrypted)));
+    ASSERT_EQ(plaintext, decrypted);
+}
+
+TEST(TestAttachment, RejectsTamperedCiphertext) {
+    string plaintext = makePlaintext();
+    string ciphertext;
+    json encrypted_file =
+        encryptAttachment(bytes(plaintext), plaintext.size(), appendTo(ciphertext));
+    ciphertext[ciphertext.size() / 2] ^= 1;
+
+    string decrypted;
+    ASSERT_FALSE(decryptAttachment(bytes(ciphertext), ciphertext.size(), encrypted_file,
+                                   appendTo(decrypted)));
+}
+
+TEST(TestAttachment, RejectsMalformedDescriptor) {
+    string ciphertext, decrypted;
+    json encrypted_file = encryptAttachment(bytes("42"), 2, appendTo(ciphertext));
+
+    json bad_alg          = encrypted_file;
+    bad_alg["key"]["alg"] = "A128CTR";
+    ASSERT_FALSE(decryptAttachment(bytes(ciphertext), 2, bad_alg, appendTo(decrypted)));
+
+    json no_hash = encrypted_file;
+    no_hash.erase("hashes");
+    ASSERT_FALSE(decryptAttachment(bytes(ciphertext), 2, no_hash, appendTo(decrypted)));
+}
+
+int main(int argc, char** argv) {
+    cout << "---RUNNING ATTACHMENT TESTS---" << endl;
+    testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
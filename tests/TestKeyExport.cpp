@@ -0,0 +1,203 @@
+#include <algorithm>
+#include <fstream>
+#include <gtest/gtest.h>
+#include <json.hpp>
+#include <memory>
+#include <sodium.h>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "KeyExport.hpp"
+
+using namespace OlmWrapper;
+
+// Few rounds keep the tests fast, the format is the same
+const unsigned test_rounds = 1000;
+
+// An export of two sessions with the passphrase "Don't Panic", written by an
+// independent implementation of the spec rather than by exportRoomKeys. It
+// uses 1000 rounds, an IV whose counter carries into bit 63 partway through,
+// and padded base64 in lines of 96 characters.
+const char* ExternalExport = "tests/data/KeyExport.txt";
+
+// Creates an inbound session the way a recipient of an m.room_key would
+InboundGroupSession makeSession(const string& room_id) {
+    unique_ptr<uint8_t[]> memory(new uint8_t[olm_outbound_group_session_size()]);
+    OlmOutboundGroupSession* outbound = olm_outbound_group_session(memory.get());
+    size_t random_len = olm_init_outbound_group_session_random_length(outbound);
+    vector<uint8_t> random(random_len);
+    randombytes_buf(random.data(), random_len);
+    olm_init_outbound_group_session(outbound, random.data(), random_len);
+
+    size_t key_len = olm_outbound_group_session_key_length(outbound);
+    vector<uint8_t> key(key_len);
+    olm_outbound_group_session_key(outbound, key.data(), key_len);
+    olm_clear_outbound_group_session(outbound);
+
+    InboundGroupSession s;
+    s.session = newInboundGroupSession();
+    olm_init_inbound_group_session(s.session.get(), key.data(), key_len);
+    s.room_id                        = room_id;
+    s.sender_key                     = "IlRMeOPX2e0MurIyfWEucYBRVOEEUMrOHqn/8mLqMjA";
+    s.sender_claimed_keys["ed25519"] = "lEuiRJBit0IG6nUf5pUzWTUEsRVVe/HJkoKuEww9ULI";
+    return s;
+}
+
+void fillStore(GroupSessionStore& store, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        InboundGroupSession s = makeSession("!room" + to_string(i % 7) + ":example.com");
+        string session_id     = inboundGroupSessionId(s.session.get());
+        store.add(session_id, s);
+    }
+}
+
+TEST(TestKeyExport, Format) {
+    GroupSessionStore store;
+    fillStore(store, 3);
+    stringstream out;
+    ASSERT_FALSE(exportRoomKeys(store, "passphrase", out, test_rounds));
+
+    vector<string> lines;
+    string line;
+    while (getline(out, line)) {
+        lines.push_back(line);
+    }
+    ASSERT_GE(lines.size(), 3u);
+    ASSERT_EQ("-----BEGIN MEGOLM SESSION DATA-----", lines.front());
+    ASSERT_EQ("-----END MEGOLM SESSION DATA-----", lines.back());
+    for (size_t i = 1; i + 2 < lines.size(); ++i) {
+        ASSERT_EQ(96u, lines[i].size());
+    }
+}
+
+TEST(TestKeyExport, RoundTripEmpty) {
+    GroupSessionStore store, imported;
+    stringstream out;
+    ASSERT_FALSE(exportRoomKeys(store, "passphrase", out, test_rounds));
+
+    auto result = importRoomKeys(imported, "passphrase", out);
+    ASSERT_FALSE(get<1>(result));
+    ASSERT_EQ(0u, get<0>(result));
+}
+
+// Enough sessions to span several batches
+TEST(TestKeyExport, RoundTripParallel) {
+    GroupSessionStore store, imported;
+    fillStore(store, 2500);
+    stringstream out;
+    ASSERT_FALSE(exportRoomKeys(store, "passphrase", out, test_rounds, 4));
+
+    auto result = importRoomKeys(imported, "passphrase", out, 4);
+    ASSERT_FALSE(get<1>(result));
+    ASSERT_EQ(store.size(), get<0>(result));
+    ASSERT_EQ(store.size(), imported.size());
+
+    for (auto& elem : store.batch(store.size())) {
+        auto key = elem.first;
+        auto s   = imported.get(get<0>(key), get<1>(key), get<2>(key));
+        ASSERT_TRUE(s.session != nullptr);
+        ASSERT_EQ(get<2>(key), inboundGroupSessionId(s.session.get()));
+        ASSERT_EQ(elem.second.sender_claimed_keys, s.sender_claimed_keys);
+    }
+}
+
+TEST(TestKeyExport, ImportsExternalExport) {
+    GroupSessionStore imported;
+    ifstream in(ExternalExport);
+    ASSERT_TRUE(in.good());
+
+    auto result = importRoomKeys(imported, "Don't Panic", in);
+    ASSERT_FALSE(get<1>(result));
+    ASSERT_EQ(2u, get<0>(result));
+
+    const string sender_key = "IlRMeOPX2e0MurIyfWEucYBRVOEEUMrOHqn/8mLqMjA";
+    auto zarquon = imported.get("!zarquon:example.org", sender_key,
+                                "YZLxpaWW3Aoc9d4HroELT1McIfJpD/Mr5e5/xjTWHsU");
+    ASSERT_TRUE(zarquon.session != nullptr);
+    ASSERT_EQ(0u, olm_inbound_group_session_first_known_index(zarquon.session.get()));
+    ASSERT_EQ("lEuiRJBit0IG6nUf5pUzWTUEsRVVe/HJkoKuEww9ULI",
+              zarquon.sender_claimed_keys["ed25519"].get<string>());
+    ASSERT_TRUE(zarquon.forwarding_curve25519_key_chain.empty());
+
+    auto milliways = imported.get("!milliways:example.org", sender_key,
+                                  "SOW1ucVWcclNL43ITY9Dvi+vk4Z3YX02qv2Ye/iqVio");
+    ASSERT_TRUE(milliways.session != nullptr);
+    ASSERT_EQ(42u, olm_inbound_group_session_first_known_index(milliways.session.get()));
+    ASSERT_EQ(json({"hPQNcabIABgGnx3/ACv/jmMmiQHoeFfuLB17tzWp6Hw"}),
+              milliways.forwarding_curve25519_key_chain);
+}
+
+TEST(TestKeyExport, ReportsUnserializableSession) {
+    GroupSessionStore store;
+    fillStore(store, 10);
+    // json can't serialize strings which aren't valid UTF-8
+    InboundGroupSession bad = makeSession("!r\xff:example.com");
+    store.add(inboundGroupSessionId(bad.session.get()), bad);
+
+    stringstream out;
+    KeyExportError err;
+    ASSERT_NO_THROW(err = exportRoomKeys(store, "passphrase", out, test_rounds, 4));
+    ASSERT_TRUE(err);
+}
+
+TEST(TestKeyExport, WrongPassphrase) {
+    GroupSessionStore store, imported;
+    fillStore(store, 10);
+    stringstream out;
+    ASSERT_FALSE(exportRoomKeys(store, "passphrase", out, test_rounds));
+
+    auto result = importRoomKeys(imported, "wrong", out);
+    ASSERT_TRUE(get<1>(result));
+    ASSERT_EQ(0u, imported.size());
+}
+
+TEST(TestKeyExport, TamperedExport) {
+    GroupSessionStore store, imported;
+    fillStore(store, 10);
+    stringstream out;
+    ASSERT_FALSE(exportRoomKeys(store, "passphrase", out, test_rounds));
+
+    // Flip a character in the middle of the base64 body
+    string text = out.str();
+    size_t pos  = text.size() / 2;
+    text[pos]   = text[pos] == 'A' ? 'B' : 'A';
+    stringstream in(text);
+
+    auto result = importRoomKeys(imported, "passphrase", in);
+    ASSERT_TRUE(get<1>(result));
+    ASSERT_EQ(0u, imported.size());
+}
+
+TEST(TestKeyExport, RejectsExcessiveRounds) {
+    GroupSessionStore store, imported;
+    stringstream out;
+    ASSERT_TRUE(exportRoomKeys(store, "passphrase", out, key_export_max_rounds + 1));
+
+    // version | salt | iv | rounds | mac, asking for 2^32 - 1 rounds
+    vector<uint8_t> raw(1 + 16 + 16 + 4 + 32, 0);
+    raw[0] = 1;
+    fill(raw.begin() + 33, raw.begin() + 37, 0xFF);
+    vector<char> b64(sodium_base64_ENCODED_LEN(raw.size(), sodium_base64_VARIANT_ORIGINAL));
+    sodium_bin2base64(b64.data(), b64.size(), raw.data(), raw.size(),
+                      sodium_base64_VARIANT_ORIGINAL);
+    stringstream in("-----BEGIN MEGOLM SESSION DATA-----\n" + string(b64.data()) +
+                    "\n-----END MEGOLM SESSION DATA-----\n");
+
+    auto result = importRoomKeys(imported, "passphrase", in);
+    ASSERT_TRUE(get<1>(result));
+    ASSERT_EQ("Key export uses more KDF rounds than allowed", *get<1>(result));
+}
+
+TEST(TestKeyExport, MissingHeader) {
+    GroupSessionStore imported;
+    stringstream in("not a key export\n");
+    auto result = importRoomKeys(imported, "passphrase", in);
+    ASSERT_TRUE(get<1>(result));
+}
+
+int main(int argc, char** argv) {
+    cout << "---RUNNING KEY EXPORT TESTS---" << endl;
+    testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -0,0 +1,148 @@
+#include <gtest/gtest.h>
+#include <json.hpp>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include "Logger.hpp"
+#include "Metrics.hpp"
+
+using namespace OlmWrapper;
+
+TEST(TestMetrics, CounterAndGauge) {
+    Counter c;
+    c.inc();
+    c.inc(41);
+    ASSERT_EQ(42u, c.get());
+
+    Gauge g;
+    g.set(100);
+    g.add(-58);
+    ASSERT_EQ(42, g.get());
+}
+
+TEST(TestMetrics, HistogramBuckets) {
+    Histogram h;
+    h.observe(10);       // first bucket
+    h.observe(50);       // bounds are inclusive
+    h.observe(51);       // second bucket
+    h.observe(20000000); // +Inf
+
+    auto counts = h.bucketCounts();
+    ASSERT_EQ(2u, counts[0]);
+    ASSERT_EQ(1u, counts[1]);
+    ASSERT_EQ(1u, counts.back());
+    ASSERT_EQ(4u, h.count());
+    ASSERT_EQ(20000111u, h.sum());
+}
+
+TEST(TestMetrics, TimerRecordsFailures) {
+    Metrics m;
+    { Metrics::Timer t(m, Op::Sign); }
+    {
+        Metrics::Timer t(m, Op::Sign);
+        t.fail();
+    }
+    try {
+        Metrics::Timer t(m, Op::Sign);
+        throw 42;
+    } catch (int) {
+    }
+
+    ASSERT_EQ(3u, m.op(Op::Sign).calls.get());
+    ASSERT_EQ(2u, m.op(Op::Sign).errors.get());
+    ASSERT_EQ(3u, m.op(Op::Sign).latency.count());
+    ASSERT_EQ(0u, m.op(Op::Verify).calls.get());
+}
+
+TEST(TestMetrics, PrometheusExport) {
+    Metrics m;
+    m.op(Op::ClaimKeys).calls.inc(3);
+    m.op(Op::ClaimKeys).latency.observe(1000);
+    m.one_time_keys.set(50);
+
+    stringstream out;
+    PrometheusTextSink sink(out);
+    m.exportTo(sink);
+    string text = out.str();
+
+    ASSERT_NE(string::npos, text.find("matrix_olm_wrapper_op_calls_total{op=\"claim_keys\"} 3\n"));
+    ASSERT_NE(string::npos,
+              text.find("matrix_olm_wrapper_op_latency_seconds_bucket{op=\"claim_keys\",le=\"0.001\"} 1\n"));
+    ASSERT_NE(string::npos,
+              text.find("matrix_olm_wrapper_op_latency_seconds_bucket{op=\"claim_keys\",le=\"+Inf\"} 1\n"));
+    ASSERT_NE(string::npos, text.find("matrix_olm_wrapper_one_time_keys 50\n"));
+}
+
+TEST(TestMetrics, CallbackExport) {
+    Metrics m;
+    m.prefetch_sessions_present.inc(7);
+
+    uint64_t present = 0;
+    CallbackSink sink([&](const MetricsSnapshot& snap) { present = snap.prefetch_sessions_present; });
+    m.exportTo(sink);
+    ASSERT_EQ(7u, present);
+}
+
+TEST(TestMetrics, LoggerRateLimits) {
+    Counter suppressed;
+    vector<json> records;
+    Logger logger([&](const json& r) { records.push_back(r); }, 0.0, 2, &suppressed);
+
+    for (int i = 0; i < 5; ++i) {
+        logger.error("key_signing_failed", {{"what", "boom"}});
+    }
+    logger.warn("other_event");
+
+    ASSERT_EQ(3u, records.size());
+    ASSERT_EQ("error", records[0]["level"].get<string>());
+    ASSERT_EQ("key_signing_failed", records[0]["event"].get<string>());
+    ASSERT_EQ("boom", records[0]["what"].get<string>());
+    ASSERT_EQ("other_event", records[2]["event"].get<string>());
+    ASSERT_EQ(3u, suppressed.get());
+}
+
+TEST(TestMetrics, LoggerReportsSuppressed) {
+    vector<json> records;
+    Logger logger([&](const json& r) { records.push_back(r); }, 20.0, 1);
+
+    logger.error("replenish");
+    logger.error("replenish");
+    this_thread::sleep_for(chrono::milliseconds(100));
+    logger.error("replenish");
+
+    ASSERT_EQ(2u, records.size());
+    ASSERT_EQ(0u, records[0].count("suppressed"));
+    ASSERT_EQ(1u, records[1]["suppressed"].get<uint64_t>());
+}
+
+TEST(TestMetrics, LoggerRepairsInvalidUtf8) {
+    Logger logger([](const json& r) { cout << r.dump() << endl; });
+    ASSERT_NO_THROW(logger.warn("bad_bytes", {{"what", "last read: '\xff\xfe'"}, {"nested", {"\xc3"}}}));
+
+    vector<json> records;
+    logger.setSink([&](const json& r) { records.push_back(r); });
+    logger.warn("bad_bytes", {{"what", "ok \xc3\xa9 \xff"}});
+    ASSERT_EQ(1u, records.size());
+    ASSERT_EQ("ok \xc3\xa9 \xef\xbf\xbd", records[0]["what"].get<string>());
+}
+
+TEST(TestMetrics, LoggerSinkMayLogOrThrow) {
+    Logger logger;
+    int calls = 0;
+    logger.setSink([&](const json&) {
+        if (++calls == 1) {
+            logger.warn("from_sink");
+        }
+        throw runtime_error("sink failed");
+    });
+    ASSERT_NO_THROW(logger.warn("outer"));
+    ASSERT_EQ(2, calls);
+}
+
+int main(int argc, char** argv) {
+    cout << "---RUNNING METRICS TESTS---" << endl;
+    testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -0,0 +1,66 @@
+#include <gtest/gtest.h>
+#include <string>
+
+#include "ReplayCache.hpp"
+
+using namespace OlmWrapper;
+
+TEST(TestReplayCache, DetectsDuplicate) {
+    ReplayCache cache;
+    auto key = ReplayCache::olmKey("sender", "ciphertext");
+    ASSERT_FALSE(cache.contains(key));
+    ASSERT_FALSE(cache.checkAndInsert(key));
+    ASSERT_TRUE(cache.contains(key));
+    ASSERT_TRUE(cache.checkAndInsert(key));
+}
+
+TEST(TestReplayCache, EraseForgetsKey) {
+    ReplayCache cache;
+    auto key = ReplayCache::megolmKey("session", 7);
+    ASSERT_FALSE(cache.checkAndInsert(key));
+    cache.erase(key);
+    ASSERT_FALSE(cache.contains(key));
+    ASSERT_FALSE(cache.checkAndInsert(key));
+    ASSERT_TRUE(cache.checkAndInsert(key));
+}
+
+TEST(TestReplayCache, KeysAreDistinct) {
+    ASSERT_FALSE(ReplayCache::olmKey("sender", "ciphertext") ==
+                 ReplayCache::olmKey("sender", "ciphertexT"));
+    ASSERT_FALSE(ReplayCache::olmKey("ab", "c") == ReplayCache::olmKey("a", "bc"));
+    ASSERT_FALSE(ReplayCache::megolmKey("session", 1) == ReplayCache::megolmKey("session", 2));
+    ASSERT_TRUE(ReplayCache::megolmKey("session", 1) == ReplayCache::megolmKey("session", 1));
+}
+
+TEST(TestReplayCache, NoFalsePositives) {
+    ReplayCache cache(2000);
+    for (uint32_t i = 0; i < 1000; ++i) {
+        cache.insert(ReplayCache::megolmKey("session", i));
+    }
+    for (uint32_t i = 1000; i < 100000; ++i) {
+        ASSERT_FALSE(cache.contains(ReplayCache::megolmKey("session", i)));
+    }
+}
+
+TEST(TestReplayCache, WindowSlides) {
+    ReplayCache cache(100);
+    for (uint32_t i = 0; i < 100; ++i) {
+        cache.insert(ReplayCache::megolmKey("session", i));
+    }
+    // The two most recent generations are still remembered
+    ASSERT_TRUE(cache.contains(ReplayCache::megolmKey("session", 0)));
+    ASSERT_TRUE(cache.contains(ReplayCache::megolmKey("session", 99)));
+
+    for (uint32_t i = 100; i < 150; ++i) {
+        cache.insert(ReplayCache::megolmKey("session", i));
+    }
+    ASSERT_FALSE(cache.contains(ReplayCache::megolmKey("session", 0)));
+    ASSERT_TRUE(cache.contains(ReplayCache::megolmKey("session", 50)));
+    ASSERT_TRUE(cache.contains(ReplayCache::megolmKey("session", 149)));
+}
+
+int main(int argc, char** argv) {
+    cout << "---RUNNING REPLAY CACHE TESTS---" << endl;
+    testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -0,0 +1,113 @@
+#include <atomic>
+#include <chrono>
+#include <gtest/gtest.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "SessionPrefetcher.hpp"
+
+using namespace OlmWrapper;
+
+// Claims as many keys as allowed and remembers who they were claimed from
+struct FakeEstablish {
+    size_t operator()(const string& user_id, size_t max_claims) {
+        claims[user_id] += max_claims;
+        return max_claims;
+    }
+
+    unordered_map<string, size_t> claims;
+};
+
+TEST(TestSessionPrefetcher, IgnoresInfrequentPeers) {
+    FakeEstablish fake;
+    SessionPrefetcher prefetcher([&](const string& u, size_t n) { return fake(u, n); });
+
+    prefetcher.recordSend("@alice:example.com");
+    ASSERT_EQ(0u, prefetcher.runOnce());
+    ASSERT_EQ(0u, fake.claims.size());
+}
+
+TEST(TestSessionPrefetcher, PrefetchesFrequentPeers) {
+    FakeEstablish fake;
+    PrefetchConfig config;
+    config.max_claims_per_peer = 3;
+    SessionPrefetcher prefetcher([&](const string& u, size_t n) { return fake(u, n); }, config);
+
+    for (int i = 0; i < 5; ++i) {
+        prefetcher.recordSend("@alice:example.com");
+    }
+    prefetcher.recordSend("@bob:example.com");
+
+    ASSERT_EQ(3u, prefetcher.runOnce());
+    ASSERT_EQ(3u, fake.claims["@alice:example.com"]);
+    ASSERT_EQ(0u, fake.claims.count("@bob:example.com"));
+}
+
+TEST(TestSessionPrefetcher, HintsArePrefetched) {
+    FakeEstablish fake;
+    SessionPrefetcher prefetcher([&](const string& u, size_t n) { return fake(u, n); });
+
+    prefetcher.hint({"@alice:example.com", "@bob:example.com"});
+    prefetcher.runOnce();
+    ASSERT_EQ(2u, fake.claims.size());
+}
+
+TEST(TestSessionPrefetcher, RespectsPerPeerBudget) {
+    FakeEstablish fake;
+    PrefetchConfig config;
+    config.max_claims_per_peer = 2;
+    config.recheck_interval    = chrono::seconds(0);
+    SessionPrefetcher prefetcher([&](const string& u, size_t n) { return fake(u, n); }, config);
+
+    prefetcher.hint({"@alice:example.com"});
+    for (int i = 0; i < 10; ++i) {
+        prefetcher.runOnce();
+    }
+    ASSERT_EQ(2u, fake.claims["@alice:example.com"]);
+}
+
+TEST(TestSessionPrefetcher, BudgetSurvivesForgettingPeers) {
+    FakeEstablish fake;
+    PrefetchConfig config;
+    config.max_claims_per_peer = 2;
+    config.recheck_interval    = chrono::seconds(0);
+    config.max_tracked_peers   = 4;
+    SessionPrefetcher prefetcher([&](const string& u, size_t n) { return fake(u, n); }, config);
+
+    // More peers than are tracked, so each round forgets some of them
+    vector<string> room;
+    for (int i = 0; i < 10; ++i) {
+        room.push_back("@user" + to_string(i) + ":example.com");
+    }
+    for (int round = 0; round < 6; ++round) {
+        prefetcher.hint(room);
+        prefetcher.runOnce();
+        prefetcher.hint(vector<string>(room.rbegin(), room.rend()));
+        prefetcher.runOnce();
+    }
+
+    ASSERT_FALSE(fake.claims.empty());
+    for (auto& elem : fake.claims) {
+        ASSERT_LE(elem.second, 2u) << elem.first;
+    }
+}
+
+TEST(TestSessionPrefetcher, BackgroundThreadRunsOnHint) {
+    atomic<size_t> claimed{0};
+    SessionPrefetcher prefetcher([&](const string&, size_t n) { return claimed += n, n; });
+    prefetcher.start();
+    prefetcher.hint({"@alice:example.com"});
+
+    for (int i = 0; i < 100 && claimed == 0; ++i) {
+        this_thread::sleep_for(chrono::milliseconds(10));
+    }
+    prefetcher.stop();
+    ASSERT_EQ(5u, claimed);
+}
+
+int main(int argc, char** argv) {
+    cout << "---RUNNING SESSION PREFETCHER TESTS---" << endl;
+    testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -20,6 +20,12 @@ TEST(TestUtils, GetMsgInfoInvalid) {
     auto empty = json::parse("{}");
     auto info  = getMsgInfo(empty);
     ASSERT_FALSE(get<0>(info));
+
+    // The reason is handed back for the caller to log
+    string error;
+    info = getMsgInfo(empty, &error);
+    ASSERT_FALSE(get<0>(info));
+    ASSERT_NE("", error);
 }
 TEST(TestUtils, GetMsgInfoValid) {
     auto device_keys = json::parse(getFileContents(ValidKeyUpload))["device_keys"];
@@ -48,6 +54,16 @@ TEST(TestUtils, GetMsgKey) {
     ASSERT_EQ("lEuiRJBit0IG6nUf5pUzWTUEsRVVe/HJkoKuEww9ULI", key);
 }
 
+TEST(TestUtils, GetMegolmMessageIndex) {
+    uint32_t index = 0;
+    ASSERT_TRUE(getMegolmMessageIndex("AwiWARIgAAECAwQFBgcICQoLDA0ODxAREhMUFRYXGBkaGxwdHh8", index));
+    ASSERT_EQ(150u, index);
+    ASSERT_TRUE(getMegolmMessageIndex("AwgAEiAAAQIDBAUGBwgJCgsMDQ4PEBESExQVFhcYGRobHB0eHw", index));
+    ASSERT_EQ(0u, index);
+    ASSERT_FALSE(getMegolmMessageIndex("", index));
+    ASSERT_FALSE(getMegolmMessageIndex("not base64!", index));
+}
+
 TEST(TestUtils, ToSignable) {
     auto device_keys = json::parse(getFileContents(ValidKeyUpload))["device_keys"];
     string signable;
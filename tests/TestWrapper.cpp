@@ -1,14 +1,25 @@
+#include <atomic>
 #include <experimental/optional>
 #include <functional>
 #include <gtest/gtest.h>
 #include <iostream>
 #include <json.hpp>
 #include <memory>
+#include <sodium.h>
 #include <thread>
+#include <vector>
 
+#include "APIWrapperMock.hpp"
 #include "APIWrapperTestImpl.hpp"
 #include "MatrixOlmWrapper.hpp"
 
+using ::testing::_;
+using ::testing::Assign;
+using ::testing::DoAll;
+using ::testing::NiceMock;
+using ::testing::Return;
+using ::testing::SaveArg;
+
 TEST(TestWrapper, UploadsExpectedNumKeys) {
     APIWrapperTestImpl* api = new APIWrapperTestImpl();
     MatrixOlmWrapper m(api, "HeartOfGold", "Zaphod");
@@ -24,6 +35,385 @@ TEST(TestWrapper, UploadsExpectedNumKeys) {
     ASSERT_EQ(expected_key_count, total_sum);
 }
 
+// Megolm ciphertexts at message index 150, and at index 0
+const char* MegolmIndex150 = "AwiWARIgAAECAwQFBgcICQoLDA0ODxAREhMUFRYXGBkaGxwdHh8";
+const char* MegolmIndex0   = "AwgAEiAAAQIDBAUGBwgJCgsMDQ4PEBESExQVFhcYGRobHB0eHw";
+
+json olmContent(const string& our_key, const string& our_body, const string& other_body) {
+    return {{"algorithm", "m.olm.v1.curve25519-aes-sha2"},
+            {"sender_key", "Arthur"},
+            {"ciphertext",
+             {{our_key, {{"type", 0}, {"body", our_body}}},
+              {"SomeoneElse", {{"type", 0}, {"body", other_body}}}}}};
+}
+
+json megolmContent(const string& session_id, const string& ciphertext) {
+    return {{"algorithm", "m.megolm.v1.aes-sha2"},
+            {"sender_key", "Arthur"},
+            {"device_id", "Bistromath"},
+            {"session_id", session_id},
+            {"ciphertext", ciphertext}};
+}
+
+TEST(TestWrapper, ReplayOlmKeyUsesOurCiphertext) {
+    MatrixOlmWrapper m(new APIWrapperTestImpl(), "HeartOfGold", "Zaphod");
+    this_thread::sleep_for(chrono::seconds(1));
+    string our_key = json::parse(m.getIdentityKeys())["curve25519"];
+
+    ASSERT_TRUE(m.claimMessage(olmContent(our_key, "body", "other").dump()));
+    ASSERT_FALSE(m.claimMessage(olmContent(our_key, "body", "other").dump()));
+    // Only the body addressed to this device identifies the message
+    ASSERT_FALSE(m.claimMessage(olmContent(our_key, "body", "changed").dump()));
+    ASSERT_TRUE(m.claimMessage(olmContent(our_key, "changed", "other").dump()));
+    // Messages with nothing for this device can't be identified and are let through
+    ASSERT_TRUE(m.claimMessage(olmContent("NotOurKey", "body", "other").dump()));
+    ASSERT_TRUE(m.claimMessage(olmContent("NotOurKey", "body", "other").dump()));
+}
+
+TEST(TestWrapper, ReplayOlmKeyNeedsIdentityKeys) {
+    // Keyfiles aren't supported yet, so this wrapper never gets an account
+    // or identity keys
+    MatrixOlmWrapper m(new APIWrapperTestImpl(), "HeartOfGold", "Zaphod", "keyfile", "pass");
+    ASSERT_EQ(m.getIdentityKeys(), "");
+
+    ASSERT_TRUE(m.claimMessage(olmContent("OurKey", "body", "other").dump()));
+    ASSERT_TRUE(m.claimMessage(olmContent("OurKey", "body", "other").dump()));
+}
+
+TEST(TestWrapper, ReplayAcceptsEventOrContent) {
+    MatrixOlmWrapper m(new APIWrapperTestImpl(), "HeartOfGold", "Zaphod");
+    this_thread::sleep_for(chrono::seconds(1));
+
+    json content = megolmContent("Session", MegolmIndex150);
+    json event   = {{"type", "m.room.encrypted"}, {"sender", "@zaphod:example.com"},
+                  {"content", content}};
+    ASSERT_TRUE(m.claimMessage(content.dump()));
+    ASSERT_FALSE(m.claimMessage(event.dump()));
+}
+
+TEST(TestWrapper, ReplayMegolmKeyUsesSessionAndIndex) {
+    MatrixOlmWrapper m(new APIWrapperTestImpl(), "HeartOfGold", "Zaphod");
+    this_thread::sleep_for(chrono::seconds(1));
+
+    ASSERT_TRUE(m.claimMessage(megolmContent("Session", MegolmIndex150).dump()));
+    ASSERT_FALSE(m.claimMessage(megolmContent("Session", MegolmIndex150).dump()));
+    ASSERT_TRUE(m.claimMessage(megolmContent("Session", MegolmIndex0).dump()));
+    ASSERT_TRUE(m.claimMessage(megolmContent("OtherSession", MegolmIndex150).dump()));
+    ASSERT_EQ(1u, m.metrics.replayed_messages.get());
+
+    // A released claim may be taken again, e.g. to retry a failed decryption
+    m.releaseMessage(megolmContent("Session", MegolmIndex150).dump());
+    ASSERT_TRUE(m.claimMessage(megolmContent("Session", MegolmIndex150).dump()));
+}
+
+TEST(TestWrapper, ReplayLetsThroughUnknownMessages) {
+    MatrixOlmWrapper m(new APIWrapperTestImpl(), "HeartOfGold", "Zaphod");
+    this_thread::sleep_for(chrono::seconds(1));
+
+    json unknown = {{"algorithm", "m.fake.v1"}, {"ciphertext", "Forty-two"}};
+    ASSERT_TRUE(m.claimMessage(unknown.dump()));
+    ASSERT_TRUE(m.claimMessage(unknown.dump()));
+    ASSERT_TRUE(m.claimMessage("not json"));
+    // Parse errors echo the raw bytes, which must not break logging them
+    ASSERT_TRUE(m.claimMessage("\xff\xfe"));
+    m.releaseMessage("\xff\xfe");
+    ASSERT_TRUE(m.claimMessage(megolmContent("Session", "not a megolm message").dump()));
+    ASSERT_TRUE(m.claimMessage(megolmContent("Session", "not a megolm message").dump()));
+}
+
+TEST(TestWrapper, ReplayClaimIsAtomic) {
+    MatrixOlmWrapper m(new APIWrapperTestImpl(), "HeartOfGold", "Zaphod");
+    this_thread::sleep_for(chrono::seconds(1));
+
+    string message = megolmContent("Session", MegolmIndex150).dump();
+    atomic<int> claimed(0);
+    vector<thread> threads;
+    for (int i = 0; i < 8; ++i) {
+        threads.emplace_back([&]() {
+            if (m.claimMessage(message)) {
+                ++claimed;
+            }
+        });
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+    ASSERT_EQ(1, claimed.load());
+}
+
+// A device belonging to another user, backed by its own olm account so its
+// keys and signatures are real
+class PeerDevice {
+    public:
+    PeerDevice(const string& user_id_, const string& device_id_)
+        : user_id(user_id_), device_id(device_id_), memory(olm_account_size()) {
+        acct = olm_account(memory.data());
+        vector<uint8_t> random(olm_create_account_random_length(acct));
+        randombytes_buf(random.data(), random.size());
+        olm_create_account(acct, random.data(), random.size());
+
+        vector<uint8_t> id_keys(olm_account_identity_keys_length(acct));
+        size_t len = olm_account_identity_keys(acct, id_keys.data(), id_keys.size());
+        json id    = json::parse(string(id_keys.begin(), id_keys.begin() + len));
+        curve_key  = id["curve25519"];
+        ed_key     = id["ed25519"];
+    }
+
+    ~PeerDevice() { olm_clear_account(acct); }
+
+    // Adds this device's signature to data
+    json sign(json data) const {
+        json to_sign = data;
+        to_sign.erase("signatures");
+        to_sign.erase("unsigned");
+        string message = to_sign.dump();
+
+        vector<uint8_t> sig(olm_account_signature_length(acct));
+        size_t len = olm_account_sign(acct, message.data(), message.size(), sig.data(), sig.size());
+        data["signatures"][user_id]["ed25519:" + device_id] =
+            string(sig.begin(), sig.begin() + len);
+        return data;
+    }
+
+    // The device's entry in a /keys/query response
+    json deviceKeys() const {
+        return sign({{"user_id", user_id},
+                     {"device_id", device_id},
+                     {"algorithms", {"m.olm.v1.curve25519-aes-sha2", "m.megolm.v1.aes-sha2"}},
+                     {"keys",
+                      {{"curve25519:" + device_id, curve_key}, {"ed25519:" + device_id, ed_key}}}});
+    }
+
+    // The device's entry in a /keys/claim response, signed by signer
+    json claimedKey(const PeerDevice& signer) {
+        vector<uint8_t> random(olm_account_generate_one_time_keys_random_length(acct, 1));
+        randombytes_buf(random.data(), random.size());
+        olm_account_generate_one_time_keys(acct, 1, random.data(), random.size());
+
+        vector<uint8_t> keys(olm_account_one_time_keys_length(acct));
+        size_t len = olm_account_one_time_keys(acct, keys.data(), keys.size());
+        olm_account_mark_keys_as_published(acct);
+        json otk = json::parse(string(keys.begin(), keys.begin() + len))["curve25519"];
+
+        return {{"signed_curve25519:" + otk.begin().key(),
+                 signer.sign({{"key", otk.begin().value()}})}};
+    }
+    json claimedKey() { return claimedKey(*this); }
+
+    string user_id;
+    string device_id;
+    string curve_key;
+    string ed_key;
+
+    private:
+    vector<uint8_t> memory;
+    OlmAccount* acct;
+};
+
+APIWrapper::matrAPIRet ok(const json& body) {
+    return APIWrapper::matrAPIRet(body.dump(), APIWrapper::keyRequestErr());
+}
+
+// Answers our own key uploads and returns the /keys/query response listing
+// the given devices of user_id
+void serveKeys(NiceMock<APIWrapperMock>& api, const string& user_id, const json& devices) {
+    ON_CALL(api, uploadKeys(_))
+        .WillByDefault(Return(ok({{"one_time_key_counts", {{"signed_curve25519", 100}}}})));
+    EXPECT_CALL(api, queryKeys(::testing::Eq(user_id)))
+        .WillRepeatedly(Return(ok({{"device_keys", {{user_id, devices}}}})));
+}
+
+json claimResponse(const string& user_id, const json& keys) {
+    return {{"one_time_keys", {{user_id, keys}}}};
+}
+
+// Claimed device_ids, from a /keys/claim request for user_id
+vector<string> claimedDevices(const string& claim, const string& user_id) {
+    vector<string> devices;
+    json requested = json::parse(claim)["one_time_keys"][user_id];
+    for (auto it = requested.begin(); it != requested.end(); ++it) {
+        EXPECT_EQ("signed_curve25519", it.value().get<string>());
+        devices.push_back(it.key());
+    }
+    return devices;
+}
+
+// Polls done until it holds or a few seconds have passed, returning whether it
+// held. Used to wait on the prefetcher's thread.
+bool waitFor(function<bool()> done) {
+    for (int i = 0; i < 500 && !done(); ++i) {
+        this_thread::sleep_for(chrono::milliseconds(10));
+    }
+    return done();
+}
+
+uint64_t opCalls(MatrixOlmWrapper& m, OlmWrapper::Op op) {
+    return m.metrics.snapshot().ops[static_cast<size_t>(op)].calls;
+}
+
+TEST(TestWrapper, PrefetchEstablishesSessions) {
+    PeerDevice arthur("@arthur:example.com", "Towel"), arthur2("@arthur:example.com", "Tea");
+    NiceMock<APIWrapperMock> api;
+    serveKeys(api, arthur.user_id,
+              {{arthur.device_id, arthur.deviceKeys()}, {arthur2.device_id, arthur2.deviceKeys()}});
+
+    string claim;
+    atomic<bool> claimed{false};
+    json keys = {{arthur.device_id, arthur.claimedKey()},
+                 {arthur2.device_id, arthur2.claimedKey()}};
+    EXPECT_CALL(api, claimKeys(_))
+        .WillOnce(DoAll(SaveArg<0>(&claim), Assign(&claimed, true),
+                        Return(ok(claimResponse(arthur.user_id, keys)))));
+
+    MatrixOlmWrapper m(&api, "HeartOfGold", "Zaphod");
+    m.enableSessionPrefetch();
+    m.hintActivePeers({arthur.user_id});
+    ASSERT_TRUE(waitFor([&] { return claimed && m.metrics.sessions_prefetched.get() == 2; }));
+
+    ASSERT_EQ(vector<string>({"Tea", "Towel"}), claimedDevices(claim, arthur.user_id));
+    ASSERT_EQ(2u, m.metrics.sessions_prefetched.get());
+    ASSERT_EQ(2u, m.metrics.prefetch_sessions_missing.get());
+}
+
+TEST(TestWrapper, PrefetchSkipsOwnDevice) {
+    PeerDevice ours("Zaphod", "HeartOfGold"), other("Zaphod", "Tanngrisnir");
+    NiceMock<APIWrapperMock> api;
+    serveKeys(api, "Zaphod",
+              {{ours.device_id, ours.deviceKeys()}, {other.device_id, other.deviceKeys()}});
+
+    string claim;
+    atomic<bool> claimed{false};
+    json keys = {{other.device_id, other.claimedKey()}};
+    EXPECT_CALL(api, claimKeys(_))
+        .WillOnce(DoAll(SaveArg<0>(&claim), Assign(&claimed, true),
+                        Return(ok(claimResponse("Zaphod", keys)))));
+
+    MatrixOlmWrapper m(&api, "HeartOfGold", "Zaphod");
+    m.enableSessionPrefetch();
+    m.hintActivePeers({"Zaphod"});
+    ASSERT_TRUE(waitFor([&] { return claimed && m.metrics.sessions_prefetched.get() == 1; }));
+
+    ASSERT_EQ(vector<string>({"Tanngrisnir"}), claimedDevices(claim, "Zaphod"));
+    ASSERT_EQ(1u, m.metrics.sessions_prefetched.get());
+}
+
+TEST(TestWrapper, PrefetchSkipsUntrustedDevices) {
+    const string user = "@arthur:example.com";
+    PeerDevice good(user, "Towel"), unsigned_dev(user, "Unsigned"), forged(user, "Forged"),
+        changed(user, "Changed"), impostor(user, "Impostor");
+
+    json unsigned_keys = unsigned_dev.deviceKeys();
+    unsigned_keys.erase("signatures");
+    // Keys signed by a different device than the one they belong to
+    json forged_keys       = forged.deviceKeys();
+    forged_keys["signatures"] = impostor.deviceKeys()["signatures"];
+
+    NiceMock<APIWrapperMock> api;
+    serveKeys(api, user,
+              {{good.device_id, good.deviceKeys()},
+               {unsigned_dev.device_id, unsigned_keys},
+               {forged.device_id, forged_keys},
+               {changed.device_id, changed.deviceKeys()}});
+
+    string claim;
+    atomic<bool> claimed{false};
+    EXPECT_CALL(api, claimKeys(_))
+        .WillOnce(DoAll(SaveArg<0>(&claim), Assign(&claimed, true),
+                        Return(ok(claimResponse(user, {{good.device_id, good.claimedKey()}})))));
+
+    MatrixOlmWrapper m(&api, "HeartOfGold", "Zaphod");
+    // Changed was verified with a key other than the one it now advertises
+    m.verifyDevice(user, changed.device_id, impostor.ed_key);
+    m.enableSessionPrefetch();
+    m.hintActivePeers({user});
+    ASSERT_TRUE(waitFor([&] { return claimed && m.metrics.sessions_prefetched.get() == 1; }));
+
+    ASSERT_EQ(vector<string>({"Towel"}), claimedDevices(claim, user));
+    ASSERT_EQ(1u, m.metrics.sessions_prefetched.get());
+}
+
+TEST(TestWrapper, PrefetchCapsClaims) {
+    const string user = "@arthur:example.com";
+    vector<unique_ptr<PeerDevice>> devices;
+    json device_keys;
+    for (auto dev : {"A", "B", "C", "D"}) {
+        devices.emplace_back(new PeerDevice(user, dev));
+        device_keys[dev] = devices.back()->deviceKeys();
+    }
+    NiceMock<APIWrapperMock> api;
+    serveKeys(api, user, device_keys);
+
+    string claim;
+    atomic<bool> claimed{false};
+    EXPECT_CALL(api, claimKeys(_))
+        .WillOnce(DoAll(SaveArg<0>(&claim), Assign(&claimed, true),
+                        Return(ok(claimResponse(user, json::object())))));
+
+    OlmWrapper::PrefetchConfig config;
+    config.max_claims_per_peer = 2;
+    MatrixOlmWrapper m(&api, "HeartOfGold", "Zaphod");
+    m.enableSessionPrefetch(config);
+    m.hintActivePeers({user});
+    ASSERT_TRUE(waitFor([&] { return claimed.load(); }));
+
+    ASSERT_EQ(2u, claimedDevices(claim, user).size());
+}
+
+TEST(TestWrapper, PrefetchVerifiesClaimedKeys) {
+    const string user = "@arthur:example.com";
+    PeerDevice good(user, "Towel"), forged(user, "Forged");
+    NiceMock<APIWrapperMock> api;
+    serveKeys(api, user,
+              {{good.device_id, good.deviceKeys()}, {forged.device_id, forged.deviceKeys()}});
+
+    // Forged's one-time key is signed by Towel rather than by Forged
+    json keys = {{good.device_id, good.claimedKey()}, {forged.device_id, forged.claimedKey(good)}};
+    EXPECT_CALL(api, claimKeys(_)).WillOnce(Return(ok(claimResponse(user, keys))));
+
+    MatrixOlmWrapper m(&api, "HeartOfGold", "Zaphod");
+    m.enableSessionPrefetch();
+    m.hintActivePeers({user});
+    auto verify_errors = [&] {
+        return m.metrics.snapshot().ops[static_cast<size_t>(OlmWrapper::Op::Verify)].errors;
+    };
+    ASSERT_TRUE(waitFor(
+        [&] { return m.metrics.sessions_prefetched.get() == 1 && verify_errors() == 1; }));
+}
+
+TEST(TestWrapper, PrefetchChargesMalformedClaims) {
+    const string user = "@arthur:example.com";
+    PeerDevice unsigned_key(user, "Unsigned"), not_object(user, "NotObject");
+    NiceMock<APIWrapperMock> api;
+    serveKeys(api, user,
+              {{unsigned_key.device_id, unsigned_key.deviceKeys()},
+               {not_object.device_id, not_object.deviceKeys()}});
+    // Has no devices, so it never claims anything and is queried on every
+    // run, telling us when a run has happened
+    const string sentinel = "@marvin:example.com";
+    EXPECT_CALL(api, queryKeys(::testing::Eq(sentinel)))
+        .WillRepeatedly(Return(ok({{"device_keys", {{sentinel, json::object()}}}})));
+
+    json no_signature = unsigned_key.claimedKey();
+    no_signature.begin().value().erase("signatures");
+    json keys = {{unsigned_key.device_id, no_signature}, {not_object.device_id, "Forty-two"}};
+    // The keys are used up even though they were no good, so they must not be
+    // claimed again within the budget window
+    EXPECT_CALL(api, claimKeys(_)).Times(1).WillOnce(Return(ok(claimResponse(user, keys))));
+
+    OlmWrapper::PrefetchConfig config;
+    config.max_claims_per_peer = 2;
+    config.recheck_interval    = chrono::seconds(0);
+    MatrixOlmWrapper m(&api, "HeartOfGold", "Zaphod");
+    m.enableSessionPrefetch(config);
+    for (uint64_t run = 0; run < 3; ++run) {
+        // The first run queries both users, later ones only the sentinel
+        m.hintActivePeers({user, sentinel});
+        ASSERT_TRUE(waitFor([&] { return opCalls(m, OlmWrapper::Op::QueryKeys) >= run + 2; }));
+    }
+
+    ASSERT_EQ(0u, m.metrics.sessions_prefetched.get());
+}
+
 int main(int argc, char** argv) {
     cout << "---RUNNING WRAPPER TESTS---" << endl;
     testing::InitGoogleTest(&argc, argv);